@@ -10,8 +10,30 @@
 #include <BLEDevice.h>
 #include <BLEUtils.h>
 #include <BLEServer.h>
+#include <BLE2902.h>
+#include <BLEScan.h>
 #include <EEPROM.h>
+#include <HTTPClient.h>
+#include <LittleFS.h>
+#include <WebServer.h>
 #include <WiFi.h>
+#include <WiFiUdp.h>
+#include <esp_coexist.h>
+#include <esp_now.h>
+#include <esp_partition.h>
+#include <esp_pm.h>
+#include <esp_wifi.h>
+#include <hal/gpio_ll.h>
+#include <lwip/sockets.h>
+#include <mbedtls/base64.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/md.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/pkcs5.h>
+#include <mbedtls/sha1.h>
+#include <mbedtls/ssl.h>
+#include <stdarg.h>
 
 #if CONFIG_FREERTOS_UNICORE
 static const BaseType_t app_cpu = 0;
@@ -23,14 +45,1181 @@ static const BaseType_t app_cpu = 1;
 #define SERVICE_UUID        "4fafc201-1fb5-459e-8fcc-c5c9c331914b"
 #define NETWORK_UUID        "beb5483e-36e1-4688-b7f5-ea07361b26a8"
 #define PASSWORD_UUID       "beb5483e-36e1-4688-b7f5-ea07361b26a9"
+#define STATUS_UUID         "beb5483e-36e1-4688-b7f5-ea07361b26aa"
+#define CONFIG_UUID         "beb5483e-36e1-4688-b7f5-ea07361b26ab"
 #define EEPROM_SIZE         300
 #define SETTINGS_LENGTH     50
 #define BLESERVERNAME       "YOUR APP"
 bool deviceConnected = false;
 char WIFI_NETWORK[50] = "Enter your network";
 char WIFI_PASSWORD[50] = "Enter your password";
-int WIFI_TIMEOUT_MS = 10000;
+uint32_t WIFI_TIMEOUT_MS = 10000;
+// Task periods, changeable at runtime through the settings engine
+uint32_t BLE_STATUS_PERIOD_MS = 5000;
+uint32_t WIFI_CHECK_PERIOD_MS = 10000;
+uint32_t WIFI_RETRY_PERIOD_MS = 20000;
+uint32_t MY_TASK_PERIOD_MS = 2000;
+TaskHandle_t bleStatusHandle = NULL;
+TaskHandle_t keepWiFiAliveHandle = NULL;
+TaskHandle_t myTaskHandle = NULL;
+BLECharacteristic *statusCharacteristic = NULL;
 
+// Cached WPA2 PMK, stored right after the credentials
+#define PMK_OFFSET          (SETTINGS_LENGTH*2)
+#define PMK_LENGTH          32
+#define PMK_CHECK_OFFSET    (PMK_OFFSET + PMK_LENGTH) // CRC of the credentials it belongs to
+#define PERIODS_OFFSET      (PMK_CHECK_OFFSET + 4)    // Runtime timing settings, 4 bytes each
+uint32_t wifiSaeCheck = 0;        // CRC of credentials whose AP needs SAE, no PMK
+
+// BLE connection parameter profiles (units: 1.25 ms / 10 ms)
+#define BLE_MTU             517
+#define BLE_IDLE_MS         10000 // Relax the link after this long without writes
+struct ConnProfile {
+  const char *name;
+  uint16_t minInterval;
+  uint16_t maxInterval;
+  uint16_t latency;
+  uint16_t timeout;
+};
+const ConnProfile PROFILE_FAST = {"fast", 6, 12, 0, 400};        // 7.5-15 ms for provisioning/bulk
+const ConnProfile PROFILE_RELAXED = {"relaxed", 80, 160, 4, 600}; // 100-200 ms for idle monitoring
+esp_bd_addr_t bleRemote;
+const ConnProfile *bleProfile = NULL;
+BLEServer *bleServer = NULL;
+TimerHandle_t bleIdleTimer = NULL;
+// Timer expiries handed from the timer task to bleStatus(), which may block
+#define BLE_PENDING_IDLE    0x01  // Relax the connection
+#define BLE_PENDING_WINDOW  0x02  // Provisioning window over
+uint8_t blePending = 0;
+portMUX_TYPE blePendingMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Radio coexistence
+#define COEX_MAX_DEFER_MS   30000 // Longest a WiFi connect waits for BLE
+#define ADV_FAST_MIN        0x20  // 20 ms, units of 0.625 ms
+#define ADV_FAST_MAX        0x40
+#define ADV_SLOW_MIN        0x320 // 500 ms while WiFi moves bulk data
+#define ADV_SLOW_MAX        0x640
+#define COEX_BULK_BYTES     512   // One message this big counts as bulk, or
+#define COEX_BULK_ENTER     4     // this many queued messages; bulk ends once
+#define COEX_BULK_EXIT      1     // the backlog is down to this many
+enum RadioActivity { ACT_PROVISIONING = 1, ACT_WIFI_CONNECT = 2, ACT_BULK = 4 };
+uint8_t radioActivity = 0;
+portMUX_TYPE coexMux = portMUX_INITIALIZER_UNLOCKED;
+SemaphoreHandle_t coexMutex = NULL;  // Applies policy changes in order
+
+// CPU frequency governor
+#define PM_MAX_MHZ          240   // Crypto, flash commits, bulk BLE
+#define PM_MIN_MHZ          80    // Everything else, light sleep when idle
+#define PM_MAX_MA           68    // Datasheet modem-sleep current at each
+#define PM_MIN_MA           31    // level, for the savings estimate
+enum BoostReason { BOOST_CRYPTO, BOOST_FLASH, BOOST_BLE_BULK, BOOST_COUNT };
+const char *boostNames[BOOST_COUNT] = {"crypto", "flash", "ble bulk"};
+esp_pm_lock_handle_t powerLock = NULL; // NULL = no esp_pm, the clock stays fixed
+SemaphoreHandle_t powerMutex = NULL;
+uint8_t boostDepth[BOOST_COUNT];
+uint8_t boostTotal = 0;
+unsigned long boostCount[BOOST_COUNT];
+unsigned long levelMs[2];         // Time at PM_MIN_MHZ, PM_MAX_MHZ
+unsigned long levelSince = 0;
+
+// Settings engine
+struct Setting {
+  const char *key;
+  char *value;                    // Text setting, or
+  size_t size;
+  uint32_t *number;               // numeric setting (milliseconds)
+  int offset;                     // Location in EEPROM
+  bool reported;                  // Part of the reported shadow state
+  bool desired;                   // Writable through the shadow, which is plain HTTP
+  TaskHandle_t *task;             // Woken when the value changes
+};
+Setting settings[] = {
+  {"network",      WIFI_NETWORK,  SETTINGS_LENGTH, NULL,                  0,                   true,  false, NULL},
+  {"password",     WIFI_PASSWORD, SETTINGS_LENGTH, NULL,                  SETTINGS_LENGTH,     false, false, NULL},
+  {"wifi_timeout", NULL,          0,               &WIFI_TIMEOUT_MS,      PERIODS_OFFSET,      true,  true,  NULL},
+  {"ble_status",   NULL,          0,               &BLE_STATUS_PERIOD_MS, PERIODS_OFFSET + 4,  true,  true,  &bleStatusHandle},
+  {"wifi_check",   NULL,          0,               &WIFI_CHECK_PERIOD_MS, PERIODS_OFFSET + 8,  true,  true,  &keepWiFiAliveHandle},
+  {"wifi_retry",   NULL,          0,               &WIFI_RETRY_PERIOD_MS, PERIODS_OFFSET + 12, true,  true,  &keepWiFiAliveHandle},
+  {"my_task",      NULL,          0,               &MY_TASK_PERIOD_MS,    PERIODS_OFFSET + 16, true,  true,  &myTaskHandle},
+};
+const int SETTINGS_COUNT = sizeof(settings) / sizeof(settings[0]);
+// BLE callbacks, provisioning, the shadow, the CLI and the PMK cache all
+// write the EEPROM cache; recursive so a save can commit under it
+SemaphoreHandle_t eepromMutex = NULL;
+
+// Device shadow
+#define SHADOW_URL          "http://192.168.1.100:8080/shadow"
+#define SHADOW_PERIOD_MS    60000
+#define SHADOW_DOC_SIZE     512
+uint32_t shadowReported[SETTINGS_COUNT]; // CRC of the value last reported
+
+// Factory provisioning over UART
+#define FACTORY_PROVISION   0     // 1 = provisioning protocol on Serial1
+#define PROVISION_BAUD      2000000
+#define PROVISION_RX_PIN    16
+#define PROVISION_TX_PIN    17
+#define PROVISION_SOF       0x7E
+#define PROVISION_MAX_FRAME 256
+#define PROVISION_SET       0x01  // payload: network\0password\0
+#define PROVISION_DIGEST    0x02  // payload: none
+#define PROVISION_REPLY     0x80  // OR'ed into the request type
+TaskHandle_t provisionTaskHandle = NULL;
+
+// Serial console (CLI on the USB UART)
+#define CONSOLE_LINE_LENGTH 96
+#define CONSOLE_FRAME_SIZE  256   // Largest decoded frame incl. channel byte
+enum ConsoleChannel { CHANNEL_LOG, CHANNEL_CLI, CHANNEL_RPC };
+#define RPC_GET_SETTING     0x01  // payload: key
+#define RPC_SET_SETTING     0x02  // payload: key\0value, committed right away
+#define RPC_DIGEST          0x03  // payload: none
+#define RPC_REPLY           0x80  // OR'ed into the request type
+struct ConsoleCommand {
+  const char *name;
+  const char *help;
+  void (*handler)(const char *args);
+};
+// Framed mode: every write is a COBS frame (channel byte + payload)
+// ended by 0x00, so logs, CLI and RPC can share the one UART
+bool consoleFramed = false;
+TaskHandle_t consoleTaskHandle = NULL;
+
+// Buttons and GPIO triggers
+#define INPUT_QUEUE_LEN     32
+#define DEBOUNCE_MS         30    // Level must hold this long to count
+#define LONG_PRESS_MS       5000
+#define DOUBLE_PRESS_MS     400   // Gap that still makes a double press
+#define PROVISION_WINDOW_MS 120000
+enum Gesture { GESTURE_SHORT, GESTURE_DOUBLE, GESTURE_LONG };
+const char *gestureNames[] = {"short", "double", "long"};
+struct InputPin {
+  uint8_t pin;
+  const char *name;               // Active low, internal pull-up
+};
+const InputPin inputPins[] = {
+  {0, "boot"},                    // BOOT button on most dev boards
+};
+const int INPUT_COUNT = sizeof(inputPins) / sizeof(inputPins[0]);
+struct InputEdge {
+  uint32_t time;                  // micros() in the ISR
+  uint8_t input;
+  uint8_t pressed;
+};
+struct GestureAction {
+  uint8_t input;
+  uint8_t gesture;
+  void (*action)();
+};
+QueueHandle_t inputQueue;
+TimerHandle_t provisionWindowTimer = NULL;
+unsigned long inputEdges = 0;
+volatile unsigned long inputOverruns = 0;
+unsigned long inputBusyUs = 0;        // Time spent debouncing and detecting
+
+// Log ring
+#define LOG_RING_SIZE       3072
+#define LOG_LINE_LENGTH     160
+#define LOG_RING_MAGIC      0x4C4F4753
+// Kept in RTC RAM so unsent logs survive a reset
+RTC_NOINIT_ATTR uint32_t logRingMagic;
+RTC_NOINIT_ATTR char logRing[LOG_RING_SIZE];
+RTC_NOINIT_ATTR uint32_t logHead;    // Total bytes ever written
+RTC_NOINIT_ATTR uint32_t logLines;   // Total lines ever written
+portMUX_TYPE logMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Radio/HAL event trace
+#define TRACE_RECORD        1     // 0 = no tracing
+#define TRACE_EVENTS        128
+#define TRACE_MAGIC         0x54524345
+enum TraceType { TRACE_BOOT, TRACE_WIFI_EVENT, TRACE_WIFI_TIMEOUT, TRACE_BLE_CONNECT, TRACE_BLE_DISCONNECT, TRACE_BLE_WRITE, TRACE_INPUT };
+struct __attribute__((packed)) TraceEvent {
+  uint32_t time;                  // millis() since that boot
+  uint8_t type;
+  uint8_t arg;
+};
+// Kept in RTC RAM so the events leading up to a crash survive it
+RTC_NOINIT_ATTR uint32_t traceMagic;
+RTC_NOINIT_ATTR uint32_t traceHead;
+RTC_NOINIT_ATTR TraceEvent traceRing[TRACE_EVENTS];
+
+// Remote syslog
+#define SYSLOG_HOST         "192.168.1.100"
+#define SYSLOG_PORT         514
+#define SYSLOG_PERIOD_MS    2000
+#define SYSLOG_DATAGRAM_SIZE 1024
+#define SYSLOG_PRI          134   // local0.info
+RTC_NOINIT_ATTR uint32_t syslogCursor;
+RTC_NOINIT_ATTR uint32_t syslogSequence;
+WiFiUDP syslogUdp;
+
+// WebSocket live stream
+#define WS_PORT             81
+#define WS_MAX_CLIENTS      4
+#define WS_FRAME_SIZE       512
+#define WS_METRIC_PERIOD_MS 1000
+#define WS_GUID             "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_HANDSHAKE_MS     2000  // Whole upgrade request must arrive by then
+enum WsState { WS_FREE, WS_HANDSHAKE, WS_OPEN };
+struct WsClient {
+  WiFiClient client;
+  uint8_t state;
+  unsigned long since;            // Handshake start
+  char line[128];                 // Request line being received
+  size_t lineLength;
+  char key[64];
+  uint32_t cursor;                // Position in the log ring
+  uint8_t frame[WS_FRAME_SIZE + 4];
+  size_t frameStart;
+  size_t frameEnd;
+  unsigned long overruns;
+};
+WiFiServer wsServer(WS_PORT);
+WsClient wsClients[WS_MAX_CLIENTS];
+
+// Uplink
+#define UPLINK_URL          "http://192.168.1.100:8080/telemetry"
+#define UPLINK_HTTP         0
+#define UPLINK_HTTPS        1     // HTTPS with session resumption
+#define UPLINK_COAP         2     // CoAP over UDP for battery SKUs
+#define UPLINK_ESPNOW       3     // Direct to a neighbouring device
+#define UPLINK_TRANSPORT    UPLINK_HTTP
+#define UPLINK_HOST         "telemetry.example.com"
+#define UPLINK_PORT         443
+#define UPLINK_PATH         "/telemetry"
+#define UPLINK_CA_CERT      "-----BEGIN CERTIFICATE-----\n" \
+                            "Paste your server CA here\n" \
+                            "-----END CERTIFICATE-----\n"
+#define TLS_TIMEOUT_MS      10000
+#define TLS_SESSION_SIZE    2048  // Serialized session; a kept peer cert must fit too
+#define TLS_SESSION_MAGIC   0x544C5353
+#define COAP_HOST           "192.168.1.100"
+#define COAP_PORT           5683
+#define COAP_PATH           "telemetry"
+#define COAP_CONFIRMABLE    1     // 0 = NON messages, at-most-once: a lost datagram is not retried
+#define COAP_BLOCK_SZX      5     // Block size 16 << SZX = 512 bytes
+#define COAP_ACK_TIMEOUT_MS 2000
+#define COAP_MAX_RETRANSMIT 4
+#define ESPNOW_PEER         {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF} // Set to the peer's STA MAC, the link won't start on broadcast
+#define ESPNOW_HEADER       4     // Sequence (2), fragment index, fragment count
+#define ESPNOW_FRAGMENT     (ESP_NOW_MAX_DATA_LEN - ESPNOW_HEADER)
+#define ESPNOW_RETRIES      3
+#define ESPNOW_ACK_MS       50
+#define ESPNOW_RX_QUEUE     2     // Reassembled messages waiting for the uplink task
+#define UPLINK_BUFFER_SIZE  1024  // Compressed batch incl. header
+#define TELEMETRY_PERIOD_MS 1000
+#define TELEMETRY_QUEUE_LEN 128
+#define BATCH_MIN_RECORDS   4
+#define BATCH_MAX_RECORDS   64
+#define BATCH_MAX_AGE_MS    60000
+#define RADIO_BUDGET_MS     60000 // Radio-on time allowed per hour
+#define UPLINK_RETRY_MS     5000
+#define UPLINK_MAX_ATTEMPTS 12    // Transient failures before a message is dropped
+#define LOW_HEAP_ALARM      20000
+#define TELEMETRY_SHED_FACTOR 4   // Sampling slows down this much under load
+struct __attribute__((packed)) TelemetryRecord {
+  uint32_t timestamp;
+  uint32_t freeHeap;
+  int8_t rssi;
+  uint8_t bleConnected;
+};
+QueueHandle_t telemetryQueue;
+int batchRecords = BATCH_MIN_RECORDS;
+unsigned long uplinkBytes = 0;
+unsigned long radioOnMs = 0;        // Total, never reset
+unsigned long radioWindowStart = 0;
+unsigned long radioWindowOnMs = 0;  // radioOnMs when the budget hour began
+unsigned long uplinkSends = 0;
+// Survives resets and deep sleep, so reconnects after boot resume too
+RTC_NOINIT_ATTR uint32_t tlsSessionMagic;
+RTC_NOINIT_ATTR uint32_t tlsSessionLength;
+RTC_NOINIT_ATTR uint8_t tlsSessionCache[TLS_SESSION_SIZE];
+unsigned long tlsHandshakes = 0;
+unsigned long tlsHandshakeMs = 0;
+unsigned long uplinkFailures = 0;
+unsigned long uplinkRejected = 0;   // Refused by the server, never retried
+unsigned long uplinkAbandoned = 0;  // Dropped after UPLINK_MAX_ATTEMPTS
+
+// Adaptive WiFi transmit power
+#define TXPOWER_AP_DBM      20    // Assumed AP transmit power, for the path loss
+#define TXPOWER_RSSI_TARGET -70   // Wanted level of our signal at the AP
+#define TXPOWER_MIN_MARGIN  6     // dB kept on top of the estimate
+#define TXPOWER_MAX_MARGIN  20
+#define TXPOWER_SEND_MS     1500  // Average send time that counts as struggling, well
+                                  // above a normal round trip, so MAC retries dominate
+const wifi_power_t txPowerLevels[] = {
+  WIFI_POWER_19_5dBm, WIFI_POWER_17dBm, WIFI_POWER_15dBm, WIFI_POWER_13dBm, WIFI_POWER_11dBm,
+  WIFI_POWER_8_5dBm, WIFI_POWER_7dBm, WIFI_POWER_5dBm, WIFI_POWER_2dBm,
+};
+const int TXPOWER_LEVELS = sizeof(txPowerLevels) / sizeof(txPowerLevels[0]);
+int txPowerLevel = 0;             // Index into txPowerLevels, 0 = maximum
+int txPowerMargin = TXPOWER_MIN_MARGIN;
+unsigned long txPowerChanges = 0;
+SemaphoreHandle_t txPowerMutex = NULL; // keepWiFiAlive and uplinkTask both set the power
+
+// Overload controller
+#define OVERLOAD_PERIOD_MS  1000
+#define OVERLOAD_COOLDOWN_MS 10000 // Calm this long before stepping down
+#define OVERLOAD_MAX_WORK   12
+enum LoadLevel { LOAD_NORMAL, LOAD_ELEVATED, LOAD_HIGH, LOAD_CRITICAL };
+const char *loadNames[] = {"normal", "elevated", "high", "critical"};
+// Thresholds for elevated, high, critical
+const int overloadQueuePercent[] = {50, 75, 90};  // Drop-newest queues, the ones that push back
+const int overloadHeapPercent[] = {60, 40, 0};    // Of the steady-state free heap; critical is
+                                                  // LOW_HEAP_ALARM (BLE + WiFi alone leave
+                                                  // well under 100 KB, so fixed levels never clear)
+const int overloadCpuPercent[] = {80, 90, 97};
+uint32_t overloadHeapBaseline = 0; // Free heap once WiFi first came up
+struct Degradable {
+  const char *name;
+  uint8_t level;                  // Shed from this load level up
+  void (*shed)(bool on);
+  bool shedding;
+};
+Degradable degradables[OVERLOAD_MAX_WORK];
+int degradableCount = 0;
+portMUX_TYPE overloadMux = portMUX_INITIALIZER_UNLOCKED;
+volatile uint8_t loadLevel = LOAD_NORMAL;
+int loadCpu[2] = {-1, -1};        // Busy percent per core, -1 = not measured
+int loadQueue = 0;                // Fullest outbound queue, percent
+// Flags the shedding callbacks set for their tasks
+volatile bool logShed = false;
+volatile bool telemetryShed = false;
+volatile bool wsMetricsShed = false;
+volatile bool gatewayShed = false;
+
+// Outbound scheduler
+#define DRR_QUANTUM         256   // Bytes per weight unit per round
+enum MessageClass { CLASS_ALARM, CLASS_STATE, CLASS_TELEMETRY, CLASS_LOG, CLASS_RELAY, CLASS_COUNT };
+enum DropPolicy { DROP_OLDEST, DROP_NEWEST };
+// First byte of every telemetry message; 1 was the on-device fleet, now tools/fleet_sim.py
+enum TelemetryType { TELEMETRY_BATCH = 0, TELEMETRY_GATEWAY = 2 };
+struct OutboundMessage {
+  uint8_t *data;
+  uint16_t length;
+  uint8_t messageClass;
+  unsigned long created;
+};
+struct ClassConfig {
+  const char *name;
+  uint8_t queueLimit;
+  uint8_t weight;
+  DropPolicy dropPolicy;
+};
+const ClassConfig classConfig[CLASS_COUNT] = {
+  {"alarm",     16, 8, DROP_NEWEST},  // Never lose a queued alarm
+  {"state",     16, 4, DROP_OLDEST},  // Newer state supersedes older
+  {"telemetry", 8,  2, DROP_OLDEST},
+  {"log",       16, 1, DROP_OLDEST},
+  {"relay",     16, 2, DROP_NEWEST},  // Mesh forwarding queue, full = child retries
+};
+QueueHandle_t classQueues[CLASS_COUNT];
+unsigned long classDropped[CLASS_COUNT];
+TaskHandle_t uplinkTaskHandle = NULL;
+bool publishMessage(uint8_t messageClass, const uint8_t *data, size_t length);
+
+// BLE gateway (scan and forward third-party sensors)
+#define GATEWAY_MODE        0     // 1 = scan next to the provisioning server
+#define GATEWAY_QUEUE_LEN   64
+#define GATEWAY_BATCH       16    // Readings per uplink message
+#define GATEWAY_MAX_AGE_MS  10000
+#define GATEWAY_DEDUP_SLOTS 256   // Power of two
+#define GATEWAY_DEDUP_MS    30000 // Same advert again within this is a duplicate
+struct __attribute__((packed)) GatewayReading {
+  uint8_t address[6];
+  int8_t rssi;
+  uint8_t length;
+  uint8_t data[31];
+};
+struct DedupSlot {
+  uint32_t key;
+  uint32_t seen;
+};
+// NULL-terminated address prefixes, e.g. "a4:c1:38"; none = accept all
+const char *gatewayWhitelist[] = {NULL};
+QueueHandle_t gatewayQueue;
+DedupSlot gatewayDedup[GATEWAY_DEDUP_SLOTS];
+unsigned long gatewayAdverts = 0;
+unsigned long gatewayDuplicates = 0;
+unsigned long gatewayDropped = 0;
+
+// WiFi mesh relay for devices out of AP range
+#define MESH_MODE           0     // 1 = relay for and through neighbours
+#define MESH_PREFIX         "MESH-"
+#define MESH_PASSWORD       "Enter your mesh password"
+#define MESH_PORT           4210
+#define MESH_MAX_HOPS       4
+#define MESH_HOP_PENALTY    10    // dB of RSSI one extra hop is worth
+#define MESH_DESCENDANTS    16
+#define MESH_DESCENDANT_TTL_MS 300000
+#define MESH_HEADER         7     // Origin (4), hops, sequence (2)
+// Each relay wraps the frame in its own header, at most MESH_MAX_HOPS deep
+#define MESH_FRAME_SIZE     (MESH_HEADER * MESH_MAX_HOPS + UPLINK_BUFFER_SIZE + 1)
+#define MESH_ACK_MS         500
+// Traffic only flows up to the parent, so nothing is forwarded by this:
+// it records who is behind us, for the report
+struct MeshDescendant {
+  uint32_t origin;
+  IPAddress via;
+  uint8_t hops;
+  uint32_t lastSeen;
+};
+uint8_t meshHops = 0;             // Hops to the AP, 0 = not in the mesh
+MeshDescendant meshDescendants[MESH_DESCENDANTS];
+WiFiUDP meshUdp;
+unsigned long meshRelayed = 0;
+unsigned long meshRelayBytes = 0;
+unsigned long meshRefused = 0;
+unsigned long meshOversize = 0;
+
+// Web assets served from flash (image built by tools/pack_assets.py)
+#define ASSETS_PARTITION    "assets"
+#define ASSETS_MAGIC        0x54534157 // "WAST"
+#define WEB_PORT            80
+struct __attribute__((packed)) AssetEntry {
+  char path[56];
+  uint32_t offset;
+  uint32_t length;
+  uint32_t etag;
+};
+const uint8_t *assets = NULL;     // Memory-mapped partition
+uint32_t assetCount = 0;
+WebServer webServer(WEB_PORT);
+
+// LittleFS log and data partition
+#define FS_PARTITION        "spiffs" // Data partition of the default scheme
+#define FS_LOG_DIR          "/log"
+#define FS_DATA_DIR         "/data"
+#define FS_SEGMENT_SIZE     16384
+#define FS_SEGMENT_AGE_MS   3600000 // Close a segment this old even when small
+#define FS_LOG_SEGMENTS     16
+#define FS_DATA_SEGMENTS    32
+#define FS_FULL_PERCENT     90    // Prune the oldest segments above this
+#define FS_PERIOD_MS        1000
+#define FS_COMPACT_BLOCK    512   // Log bytes per compressed block
+#define FS_COMPACT_SLICE_MS 5     // Compaction work per wakeup
+#define FS_DATA_QUEUE_LEN   32
+RTC_NOINIT_ATTR uint32_t fsLogCursor; // Position in the log ring already on flash
+bool fsMounted = false;
+QueueHandle_t fsDataQueue = NULL;
+volatile bool fsCompactShed = false;
+
+// Console output functions
+/********************************************
+ * name: consoleWrite()
+ * parameters: channel, data, length
+ * description: Writes to the UART console,
+ * as one COBS frame in framed mode. A frame
+ * goes out in a single write, so frames from
+ * different tasks never interleave. RPC
+ * replies are dropped in plain mode.
+ ********************************************/
+void consoleWrite(uint8_t channel, const uint8_t *data, size_t length){
+  if(!consoleFramed){
+    if(channel != CHANNEL_RPC){
+      Serial.write(data, length);
+    }
+    return;
+  }
+  length = min(length, (size_t)CONSOLE_FRAME_SIZE - 1);
+  uint8_t frame[CONSOLE_FRAME_SIZE + CONSOLE_FRAME_SIZE / 254 + 3];
+  size_t code = 0;                // Where the current run's code byte goes
+  size_t out = 1;
+  for(size_t i=0;i<=length;i++){
+    uint8_t byte = i == 0 ? channel : data[i - 1];
+    if(byte == 0){
+      frame[code] = out - code;
+      code = out++;
+      continue;
+    }
+    frame[out++] = byte;
+    if(out - code == 0xFF){
+      frame[code] = 0xFF;
+      code = out++;
+    }
+  }
+  frame[code] = out - code;
+  frame[out++] = 0;
+  Serial.write(frame, out);
+}
+/********************************************
+ * name: consolePrintf()
+ * parameters: format, ...
+ * description: printf-style CLI output.
+ ********************************************/
+void consolePrintf(const char *format, ...){
+  char text[LOG_LINE_LENGTH];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  length = constrain(length, 0, (int)sizeof(text) - 1);
+  consoleWrite(CHANNEL_CLI, (const uint8_t *)text, length);
+}
+// Log ring functions
+/********************************************
+ * name: logRingInit()
+ * parameters: none
+ * description: Keeps the log ring across a
+ * reset, or clears it after power-on when
+ * RTC RAM holds garbage.
+ ********************************************/
+void logRingInit(){
+  if(logRingMagic != LOG_RING_MAGIC || syslogCursor > logHead){
+    logHead = 0;
+    logLines = 0;
+    syslogCursor = 0;
+    syslogSequence = 0;
+    logRingMagic = LOG_RING_MAGIC;
+  }
+  if(fsLogCursor > logHead){
+    fsLogCursor = logHead;
+  }
+}
+/********************************************
+ * name: logRingWrite()
+ * parameters: text, length
+ * description: Appends to the log ring. Never
+ * blocks; old data is simply overwritten.
+ ********************************************/
+void logRingWrite(const char *text, size_t length){
+  portENTER_CRITICAL(&logMux);
+  for(size_t i=0;i<length;i++){
+    logRing[(logHead + i) % LOG_RING_SIZE] = text[i];
+    if(text[i] == '\n'){
+      logLines++;
+    }
+  }
+  logHead += length;
+  portEXIT_CRITICAL(&logMux);
+}
+/********************************************
+ * name: logRingRead()
+ * parameters: *cursor, out, size, *overrun
+ * description: Copies up to size bytes from
+ * a reader's cursor. A reader that fell more
+ * than the ring behind skips to the oldest
+ * data still held and gets overrun = true.
+ ********************************************/
+size_t logRingRead(uint32_t *cursor, char *out, size_t size, bool *overrun){
+  portENTER_CRITICAL(&logMux);
+  *overrun = logHead - *cursor > LOG_RING_SIZE;
+  if(*overrun){
+    *cursor = logHead - LOG_RING_SIZE;
+  }
+  size_t length = min((size_t)(logHead - *cursor), size);
+  for(size_t i=0;i<length;i++){
+    out[i] = logRing[(*cursor + i) % LOG_RING_SIZE];
+  }
+  *cursor += length;
+  portEXIT_CRITICAL(&logMux);
+  return length;
+}
+/********************************************
+ * name: logRingLineAt()
+ * parameters: cursor
+ * description: Number of lines written
+ * before cursor, found by counting back from
+ * the head. cursor must still be in the ring.
+ ********************************************/
+uint32_t logRingLineAt(uint32_t cursor){
+  portENTER_CRITICAL(&logMux);
+  uint32_t lines = logLines;
+  for(uint32_t i=cursor;i!=logHead;i++){
+    if(logRing[i % LOG_RING_SIZE] == '\n'){
+      lines--;
+    }
+  }
+  portEXIT_CRITICAL(&logMux);
+  return lines;
+}
+/********************************************
+ * name: logLine(), logLineV()
+ * parameters: format, ... / format, args
+ * description: printf-style log line to the
+ * UART and the log ring.
+ ********************************************/
+void logLineV(const char *format, va_list args){
+  char line[LOG_LINE_LENGTH];
+  int length = vsnprintf(line, sizeof(line) - 1, format, args);
+  length = constrain(length, 0, (int)sizeof(line) - 2);
+  line[length++] = '\n';
+  consoleWrite(CHANNEL_LOG, (const uint8_t *)line, length);
+  logRingWrite(line, length);
+}
+void logLine(const char *format, ...){
+  va_list args;
+  va_start(args, format);
+  logLineV(format, args);
+  va_end(args);
+}
+/********************************************
+ * name: logDebug()
+ * parameters: format, ...
+ * description: Like logLine() for routine
+ * status lines, which the overload
+ * controller sheds first.
+ ********************************************/
+void logDebug(const char *format, ...){
+  if(logShed){
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  logLineV(format, args);
+  va_end(args);
+}
+// Trace functions
+/********************************************
+ * name: traceEvent()
+ * parameters: type, arg
+ * description: Records one radio/HAL event
+ * in the crash-persistent trace ring.
+ ********************************************/
+void traceEvent(uint8_t type, uint8_t arg){
+#if TRACE_RECORD
+  portENTER_CRITICAL(&logMux);
+  TraceEvent &event = traceRing[traceHead % TRACE_EVENTS];
+  event.time = millis();
+  event.type = type;
+  event.arg = arg;
+  traceHead++;
+  portEXIT_CRITICAL(&logMux);
+#endif
+}
+/********************************************
+ * name: traceInit()
+ * parameters: none
+ * description: Dumps the trace left over
+ * from previous boots to the UART as hex
+ * (time, type, arg per event, oldest first)
+ * for offline replay, then marks this boot.
+ ********************************************/
+void traceInit(){
+  if(traceMagic != TRACE_MAGIC){
+    traceHead = 0;
+    traceMagic = TRACE_MAGIC;
+  }
+  uint32_t first = traceHead > TRACE_EVENTS ? traceHead - TRACE_EVENTS : 0;
+  Serial.printf("[TRACE] %u events\n", (unsigned)(traceHead - first));
+  for(uint32_t i=first;i<traceHead;i++){
+    TraceEvent &event = traceRing[i % TRACE_EVENTS];
+    Serial.printf("[TRACE] %08x %02x %02x\n", (unsigned)event.time, event.type, event.arg);
+  }
+  traceEvent(TRACE_BOOT, esp_reset_reason());
+}
+/********************************************
+ * name: traceWiFiEvent()
+ * parameters: event
+ * description: WiFi event handler feeding
+ * every radio state change into the trace.
+ ********************************************/
+void traceWiFiEvent(WiFiEvent_t event){
+  traceEvent(TRACE_WIFI_EVENT, event);
+}
+// Governor functions
+/********************************************
+ * name: powerInit()
+ * parameters: none
+ * description: Lets esp_pm scale between
+ * PM_MIN_MHZ and PM_MAX_MHZ, with light
+ * sleep when the core build has tickless
+ * idle. Without esp_pm the clock stays where
+ * the core set it: changing it under the
+ * running WiFi, BLE and UART drivers is not
+ * safe, so the governor only records the
+ * levels it would have asked for.
+ ********************************************/
+void powerInit(){
+  powerMutex = xSemaphoreCreateMutex();
+  levelSince = millis();
+#if CONFIG_PM_ENABLE
+  esp_pm_config_esp32_t config;
+  config.max_freq_mhz = PM_MAX_MHZ;
+  config.min_freq_mhz = PM_MIN_MHZ;
+  config.light_sleep_enable = true;
+  esp_err_t err = esp_pm_configure(&config);
+  if(err != ESP_OK){
+    config.light_sleep_enable = false;
+    err = esp_pm_configure(&config);
+  }
+  if(err == ESP_OK && esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "boost", &powerLock) == ESP_OK){
+    logLine("[PM] esp_pm %d-%d MHz, light sleep %s", PM_MIN_MHZ, PM_MAX_MHZ, config.light_sleep_enable ? "on" : "off");
+    return;
+  }
+#endif
+  logLine("[PM] No esp_pm, clock fixed at %u MHz", (unsigned)getCpuFrequencyMhz());
+}
+/********************************************
+ * name: powerAdjust()
+ * parameters: reason, delta
+ * description: Changes a reason's hold count
+ * and moves between the two levels when the
+ * first hold starts or the last one ends.
+ * Call with powerMutex taken.
+ ********************************************/
+void powerAdjust(uint8_t reason, int delta){
+  bool wasBoosted = boostTotal > 0;
+  boostDepth[reason] += delta;
+  boostTotal += delta;
+  if(delta > 0){
+    boostCount[reason]++;
+  }
+  bool boosted = boostTotal > 0;
+  if(boosted == wasBoosted){
+    return;
+  }
+  unsigned long now = millis();
+  levelMs[wasBoosted] += now - levelSince;
+  levelSince = now;
+  if(powerLock != NULL){
+    boosted ? esp_pm_lock_acquire(powerLock) : esp_pm_lock_release(powerLock);
+  }
+}
+/********************************************
+ * name: powerBoostBegin(), powerBoostEnd()
+ * parameters: reason
+ * description: Run at PM_MAX_MHZ in between.
+ * Calls nest and may come from any task.
+ ********************************************/
+void powerBoostBegin(uint8_t reason){
+  if(powerMutex == NULL){
+    return;
+  }
+  xSemaphoreTake(powerMutex, portMAX_DELAY);
+  powerAdjust(reason, 1);
+  xSemaphoreGive(powerMutex);
+}
+void powerBoostEnd(uint8_t reason){
+  if(powerMutex == NULL){
+    return;
+  }
+  xSemaphoreTake(powerMutex, portMAX_DELAY);
+  if(boostDepth[reason] > 0){
+    powerAdjust(reason, -1);
+  }
+  xSemaphoreGive(powerMutex);
+}
+/********************************************
+ * name: powerBoostHold()
+ * parameters: reason, on
+ * description: Level-style boost for states
+ * that are entered and left from different
+ * tasks, e.g. the fast BLE profile.
+ ********************************************/
+void powerBoostHold(uint8_t reason, bool on){
+  if(powerMutex == NULL){
+    return;
+  }
+  xSemaphoreTake(powerMutex, portMAX_DELAY);
+  if(on != (boostDepth[reason] > 0)){
+    powerAdjust(reason, on ? 1 : -1);
+  }
+  xSemaphoreGive(powerMutex);
+}
+// Settings functions
+/********************************************
+ * name: crc32()
+ * parameters: data, length
+ * description: CRC-32 (IEEE 802.3).
+ ********************************************/
+uint32_t crc32(const uint8_t *data, size_t length){
+  uint32_t crc = 0xFFFFFFFF;
+  for(size_t i=0;i<length;i++){
+    crc ^= data[i];
+    for(int bit=0;bit<8;bit++){
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+/********************************************
+ * name: settingsDigest()
+ * parameters: none
+ * description: CRC-32 of the WiFi settings
+ * in the EEPROM cache. That is RAM, so it
+ * shows what was staged, not what reached
+ * flash; a failed settingsCommit() is
+ * reported alongside it.
+ ********************************************/
+uint32_t settingsDigest(){
+  uint8_t stored[SETTINGS_LENGTH*2];
+  for(int i=0;i<SETTINGS_LENGTH*2;i++){
+    stored[i] = EEPROM.read(i);
+  }
+  return crc32(stored, sizeof(stored));
+}
+/********************************************
+ * name: settingFind()
+ * parameters: key
+ * description: Looks a setting up by key.
+ ********************************************/
+Setting *settingFind(const char *key){
+  for(int i=0;i<SETTINGS_COUNT;i++){
+    if(strcmp(settings[i].key, key) == 0){
+      return &settings[i];
+    }
+  }
+  return NULL;
+}
+/********************************************
+ * name: settingRead()
+ * parameters: &setting, out, size
+ * description: Current value as text.
+ ********************************************/
+void settingRead(const Setting &setting, char *out, size_t size){
+  if(setting.number != NULL){
+    snprintf(out, size, "%u", (unsigned)*setting.number);
+  }
+  else{
+    snprintf(out, size, "%s", setting.value);
+  }
+}
+/********************************************
+ * name: settingWrite()
+ * parameters: key, value
+ * description: Stages a new value in RAM and
+ * the EEPROM cache. Nothing reaches flash
+ * until settingsCommit(), so a batch of
+ * changes costs one flash write. The owning
+ * task is notified so it re-arms its wait
+ * with the new value right away.
+ ********************************************/
+bool settingWrite(const char *key, const char *value){
+  Setting *setting = settingFind(key);
+  if(setting == NULL){
+    return false;
+  }
+  if(setting->number != NULL){
+    char *end;
+    unsigned long number = strtoul(value, &end, 10);
+    if(*value == 0 || *end != 0 || number == 0 || number > 3600000){
+      return false;
+    }
+    xSemaphoreTakeRecursive(eepromMutex, portMAX_DELAY);
+    *setting->number = number;
+    EEPROM.put(setting->offset, *setting->number);
+    xSemaphoreGiveRecursive(eepromMutex);
+  }
+  else{
+    if(strlen(value) >= setting->size){
+      return false;
+    }
+    xSemaphoreTakeRecursive(eepromMutex, portMAX_DELAY);
+    memset(setting->value, 0, setting->size);
+    strcpy(setting->value, value);
+    for(size_t i=0;i<setting->size;i++){
+      EEPROM.write(setting->offset + i, setting->value[i]);
+    }
+    xSemaphoreGiveRecursive(eepromMutex);
+  }
+  if(setting->task != NULL && *setting->task != NULL){
+    xTaskNotifyGive(*setting->task);
+  }
+  return true;
+}
+/********************************************
+ * name: settingsLoad()
+ * parameters: none
+ * description: Loads the numeric settings;
+ * erased EEPROM keeps the defaults.
+ ********************************************/
+void settingsLoad(){
+  for(int i=0;i<SETTINGS_COUNT;i++){
+    if(settings[i].number == NULL){
+      continue;
+    }
+    uint32_t stored;
+    EEPROM.get(settings[i].offset, stored);
+    if(stored != 0 && stored <= 3600000){
+      *settings[i].number = stored;
+    }
+  }
+}
+/********************************************
+ * name: taskDelayUntil()
+ * parameters: *lastWake, *periodMs
+ * description: Like vTaskDelayUntil(), but
+ * the period is read again whenever the
+ * task is notified, so a changed setting
+ * takes effect within one tick and costs no
+ * wakeups otherwise.
+ ********************************************/
+void taskDelayUntil(TickType_t *lastWake, const uint32_t *periodMs){
+  for(;;){
+    TickType_t deadline = *lastWake + *periodMs / portTICK_PERIOD_MS;
+    TickType_t now = xTaskGetTickCount();
+    if((int32_t)(deadline - now) <= 0){
+      // Skip missed periods instead of bursting
+      *lastWake = (int32_t)(now - deadline) > (int32_t)(*periodMs / portTICK_PERIOD_MS) ? now : deadline;
+      return;
+    }
+    ulTaskNotifyTake(pdTRUE, deadline - now);
+  }
+}
+/********************************************
+ * name: settingsCommit()
+ * parameters: none
+ * description: Writes the EEPROM cache to
+ * flash. Returns false if that failed.
+ ********************************************/
+bool settingsCommit(){
+  xSemaphoreTakeRecursive(eepromMutex, portMAX_DELAY);
+  powerBoostBegin(BOOST_FLASH);
+  bool committed = EEPROM.commit();
+  powerBoostEnd(BOOST_FLASH);
+  xSemaphoreGiveRecursive(eepromMutex);
+  if(!committed){
+    logLine("[EEPROM] Commit failed");
+  }
+  return committed;
+}
+/********************************************
+ * name: saveWiFiSettings()
+ * parameters: network, password
+ * description: Stages both settings through
+ * settingWrite() and commits them to flash
+ * in one go. Returns false if the commit
+ * failed.
+ ********************************************/
+bool saveWiFiSettings(const char *network, const char *password){
+  // Copies first: either argument may be the setting's own buffer
+  char networkCopy[SETTINGS_LENGTH] = {0};
+  char passwordCopy[SETTINGS_LENGTH] = {0};
+  strncpy(networkCopy, network, SETTINGS_LENGTH - 1);
+  strncpy(passwordCopy, password, SETTINGS_LENGTH - 1);
+  xSemaphoreTakeRecursive(eepromMutex, portMAX_DELAY);
+  settingWrite("network", networkCopy);
+  settingWrite("password", passwordCopy);
+  bool committed = settingsCommit();
+  xSemaphoreGiveRecursive(eepromMutex);
+  return committed;
+}
+/********************************************
+ * name: wifiCredentialsCheck()
+ * parameters: none
+ * description: CRC of the current network
+ * and password, tying cached facts about
+ * the AP to the credentials they came from.
+ ********************************************/
+uint32_t wifiCredentialsCheck(){
+  uint8_t credentials[SETTINGS_LENGTH*2];
+  xSemaphoreTakeRecursive(eepromMutex, portMAX_DELAY);
+  memcpy(credentials, WIFI_NETWORK, SETTINGS_LENGTH);
+  memcpy(credentials + SETTINGS_LENGTH, WIFI_PASSWORD, SETTINGS_LENGTH);
+  xSemaphoreGiveRecursive(eepromMutex);
+  return crc32(credentials, sizeof(credentials));
+}
+/********************************************
+ * name: wifiApUsesSae()
+ * parameters: none
+ * description: Scans for WIFI_NETWORK and
+ * reports whether it advertises WPA3-SAE.
+ * SAE authenticates with the passphrase
+ * itself, so a PMK cannot join it.
+ ********************************************/
+bool wifiApUsesSae(){
+  int count = WiFi.scanNetworks(false, false, false, 300, 0, WIFI_NETWORK);
+  bool sae = false;
+  for(int i=0;i<count;i++){
+    wifi_auth_mode_t mode = WiFi.encryptionType(i);
+    sae |= strcmp(WiFi.SSID(i).c_str(), WIFI_NETWORK) == 0 &&
+           (mode == WIFI_AUTH_WPA3_PSK || mode == WIFI_AUTH_WPA2_WPA3_PSK);
+  }
+  WiFi.scanDelete();
+  return sae;
+}
+/********************************************
+ * name: wifiPassphrase()
+ * parameters: none
+ * description: What to hand WiFi.begin().
+ * Deriving the PSK takes 4096 PBKDF2-SHA1
+ * rounds, so the 32-byte PMK is derived
+ * once per credential change, kept in
+ * EEPROM, and passed as 64 hex digits,
+ * which the supplicant uses directly. An
+ * AP found to advertise SAE gets the
+ * passphrase instead.
+ ********************************************/
+const char *wifiPassphrase(){
+  static char pmkHex[PMK_LENGTH*2+1];
+  size_t passwordLength = strlen(WIFI_PASSWORD);
+  if(passwordLength < 8){
+    // Open network
+    return WIFI_PASSWORD;
+  }
+  uint32_t check = wifiCredentialsCheck();
+  if(check == wifiSaeCheck){
+    return WIFI_PASSWORD;
+  }
+  uint32_t stored;
+  uint8_t pmk[PMK_LENGTH];
+  xSemaphoreTakeRecursive(eepromMutex, portMAX_DELAY);
+  EEPROM.get(PMK_CHECK_OFFSET, stored);
+  for(int i=0;i<PMK_LENGTH;i++){
+    pmk[i] = EEPROM.read(PMK_OFFSET + i);
+  }
+  xSemaphoreGiveRecursive(eepromMutex);
+  if(stored != check){
+    unsigned long start = millis();
+    powerBoostBegin(BOOST_CRYPTO);
+    mbedtls_md_context_t sha1;
+    mbedtls_md_init(&sha1);
+    int ret = mbedtls_md_setup(&sha1, mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), 1);
+    if(ret == 0){
+      ret = mbedtls_pkcs5_pbkdf2_hmac(&sha1, (const unsigned char *)WIFI_PASSWORD, passwordLength,
+                                      (const unsigned char *)WIFI_NETWORK, strlen(WIFI_NETWORK), 4096, PMK_LENGTH, pmk);
+    }
+    mbedtls_md_free(&sha1);
+    powerBoostEnd(BOOST_CRYPTO);
+    if(ret != 0){
+      return WIFI_PASSWORD;
+    }
+    xSemaphoreTakeRecursive(eepromMutex, portMAX_DELAY);
+    for(int i=0;i<PMK_LENGTH;i++){
+      EEPROM.write(PMK_OFFSET + i, pmk[i]);
+    }
+    EEPROM.put(PMK_CHECK_OFFSET, check);
+    settingsCommit();
+    xSemaphoreGiveRecursive(eepromMutex);
+    logLine("[WIFI] Derived PMK in %lu ms", millis() - start);
+  }
+  for(int i=0;i<PMK_LENGTH;i++){
+    sprintf(pmkHex + i*2, "%02x", pmk[i]);
+  }
+  return pmkHex;
+}
+/********************************************
+ * name: notifyProvisionStatus()
+ * parameters: field, committed
+ * description: Notifies "<field>:<digest>"
+ * on the status characteristic, so a
+ * provisioning tool can pipeline writes and
+ * verify them from the notifications, or
+ * "<field>:error" if the commit failed.
+ ********************************************/
+void notifyProvisionStatus(const char *field, bool committed){
+  if(statusCharacteristic == NULL){
+    return;
+  }
+  char status[32];
+  if(committed){
+    snprintf(status, sizeof(status), "%s:%08x", field, (unsigned)settingsDigest());
+  }
+  else{
+    snprintf(status, sizeof(status), "%s:error", field);
+  }
+  statusCharacteristic->setValue(status);
+  statusCharacteristic->notify();
+}
+// Coexistence functions
+/********************************************
+ * name: applyCoexPolicy()
+ * parameters: none
+ * description: BLE sessions get the shared
+ * antenna first; bulk WiFi transfers get it
+ * otherwise, with advertising slowed down
+ * so it steals less airtime. The decision
+ * is taken under coexMux from the latest
+ * activity, and coexMutex keeps the radio
+ * calls in the same order.
+ ********************************************/
+void applyCoexPolicy(){
+  static int lastPreference = -1;
+  static bool lastSlow = false;
+  xSemaphoreTake(coexMutex, portMAX_DELAY);
+  portENTER_CRITICAL(&coexMux);
+  int preference = ESP_COEX_PREFER_BALANCE;
+  if(radioActivity & ACT_PROVISIONING){
+    preference = ESP_COEX_PREFER_BT;
+  }
+  else if(radioActivity & ACT_BULK){
+    preference = ESP_COEX_PREFER_WIFI;
+  }
+  bool preferenceChanged = preference != lastPreference;
+  lastPreference = preference;
+  // Advertising only runs while no central is connected
+  bool slow = (radioActivity & ACT_BULK) != 0;
+  bool slowChanged = slow != lastSlow && !deviceConnected;
+  if(slowChanged){
+    lastSlow = slow;
+  }
+  portEXIT_CRITICAL(&coexMux);
+  if(preferenceChanged){
+    esp_coex_preference_set((esp_coex_prefer_t)preference);
+  }
+  if(slowChanged){
+    BLEAdvertising *pAdvertising = BLEDevice::getAdvertising();
+    pAdvertising->stop();
+    pAdvertising->setMinInterval(slow ? ADV_SLOW_MIN : ADV_FAST_MIN);
+    pAdvertising->setMaxInterval(slow ? ADV_SLOW_MAX : ADV_FAST_MAX);
+    pAdvertising->start();
+  }
+  xSemaphoreGive(coexMutex);
+}
+/********************************************
+ * name: radioActivityBegin(), radioActivityEnd()
+ * parameters: activity
+ * description: Tell the coordinator what the
+ * radios are doing right now.
+ ********************************************/
+void radioActivityBegin(uint8_t activity){
+  portENTER_CRITICAL(&coexMux);
+  radioActivity |= activity;
+  portEXIT_CRITICAL(&coexMux);
+  applyCoexPolicy();
+}
+void radioActivityEnd(uint8_t activity){
+  portENTER_CRITICAL(&coexMux);
+  radioActivity &= ~activity;
+  portEXIT_CRITICAL(&coexMux);
+  applyCoexPolicy();
+}
+// Connection profile functions
+/********************************************
+ * name: setConnProfile()
+ * parameters: &profile
+ * description: Asks the central for the
+ * profile's connection parameters with an
+ * L2CAP parameter update request.
+ ********************************************/
+void setConnProfile(const ConnProfile &profile){
+  if(!deviceConnected || bleServer == NULL || bleProfile == &profile){
+    return;
+  }
+  bleServer->updateConnParams(bleRemote, profile.minInterval, profile.maxInterval, profile.latency, profile.timeout);
+  bleProfile = &profile;
+  logLine("[BLE] Connection profile %s", profile.name);
+}
+/********************************************
+ * name: blePendingSet()
+ * parameters: flags
+ * description: Hands work to bleStatus().
+ * Timer callbacks run in the timer task and
+ * must not block, so they only set a flag.
+ ********************************************/
+void blePendingSet(uint8_t flags){
+  portENTER_CRITICAL(&blePendingMux);
+  blePending |= flags;
+  portEXIT_CRITICAL(&blePendingMux);
+  xTaskNotifyGive(bleStatusHandle);
+}
+/********************************************
+ * name: bleActivity(), bleIdle()
+ * parameters: none / timer
+ * description: Switches to the fast profile
+ * on any GATT activity and restarts the
+ * idle timer, which relaxes it again from
+ * bleStatus().
+ ********************************************/
+void bleActivity(){
+  setConnProfile(PROFILE_FAST);
+  powerBoostHold(BOOST_BLE_BULK, true);
+  if(bleIdleTimer != NULL){
+    xTimerReset(bleIdleTimer, 0);
+  }
+}
+void bleIdle(TimerHandle_t timer){
+  blePendingSet(BLE_PENDING_IDLE);
+}
 // Bluetooth Service callbacks
 /********************************************
  * class name: MyServerCallbacks()
@@ -40,11 +1229,23 @@ int WIFI_TIMEOUT_MS = 10000;
  * does when connected or disconnected to.
  ********************************************/
 class MyServerCallbacks: public BLEServerCallbacks {
-  void onConnect(BLEServer* pServer){
+  void onConnect(BLEServer* pServer, esp_ble_gatts_cb_param_t *param){
     deviceConnected = true;
+    traceEvent(TRACE_BLE_CONNECT, 0);
+    radioActivityBegin(ACT_PROVISIONING);
+    // Start fast, a phone usually connects to provision
+    memcpy(bleRemote, param->connect.remote_bda, sizeof(esp_bd_addr_t));
+    bleProfile = NULL;
+    bleActivity();
+    publishMessage(CLASS_STATE, (const uint8_t *)"ble:connected", 13);
   }
   void onDisconnect(BLEServer* pServer){
     deviceConnected = false;
+    traceEvent(TRACE_BLE_DISCONNECT, 0);
+    xTimerStop(bleIdleTimer, 0);
+    powerBoostHold(BOOST_BLE_BULK, false);
+    radioActivityEnd(ACT_PROVISIONING);
+    publishMessage(CLASS_STATE, (const uint8_t *)"ble:disconnected", 16);
     pServer->getAdvertising()->start();
   }
 };
@@ -67,18 +1268,14 @@ class MyNetworkCallbacks: public BLECharacteristicCallbacks {
   void onWrite(BLECharacteristic *networkCharacteristic){
     char network[SETTINGS_LENGTH] = {0};
     std::string rxValue = networkCharacteristic->getValue();
-    for(int i=0;i<rxValue.length();i++){
+    for(int i=0;i<rxValue.length() && i<SETTINGS_LENGTH-1;i++){
       network[i] = rxValue[i];
-      Serial.println(rxValue[i]);
-    }
-    for(int i=0;i<SETTINGS_LENGTH;i++){
-      WIFI_NETWORK[i] = network[i];
-      EEPROM.write(i,network[i]);
-      EEPROM.commit();
     }
-    Serial.print("[BLE] Changed WiFi Netowrk to: ");
-    Serial.print(WIFI_NETWORK);
-    Serial.println("");
+    traceEvent(TRACE_BLE_WRITE, 0);
+    bleActivity();
+    bool committed = saveWiFiSettings(network, WIFI_PASSWORD);
+    logLine("[BLE] Changed WiFi Netowrk to: %s", WIFI_NETWORK);
+    notifyProvisionStatus("network", committed);
   }
 };
 // Bluetooth Password Characteristic callbacks
@@ -100,35 +1297,2619 @@ class MyPasswordCallbacks: public BLECharacteristicCallbacks {
   void onWrite(BLECharacteristic *passwordCharacteristic){
     char password[SETTINGS_LENGTH] = {0};
     std::string rxValue = passwordCharacteristic->getValue();
-    for(int i=0;i < rxValue.length();i++){
+    for(int i=0;i < rxValue.length() && i<SETTINGS_LENGTH-1;i++){
       password[i] = rxValue[i];
     }
-    for(int i=0;i<SETTINGS_LENGTH;i++){
-      WIFI_PASSWORD[i] = password[i];
-      EEPROM.write(SETTINGS_LENGTH+i,password[i]);
-      EEPROM.commit();
+    traceEvent(TRACE_BLE_WRITE, 1);
+    bleActivity();
+    bool committed = saveWiFiSettings(WIFI_NETWORK, password);
+    logLine("[BLE] Changed WiFi Password (%u characters)", (unsigned)strlen(WIFI_PASSWORD));
+    notifyProvisionStatus("password", committed);
+  }
+};
+// BLE gateway callbacks
+/********************************************
+ * name: gatewayIsDuplicate()
+ * parameters: address, payload, length
+ * description: Looks the advert up in an
+ * open-addressing table keyed by an FNV-1a
+ * hash of address and payload. Entries older
+ * than GATEWAY_DEDUP_MS are reused.
+ ********************************************/
+bool gatewayIsDuplicate(const uint8_t *address, const uint8_t *payload, size_t length){
+  uint32_t key = 2166136261;
+  for(int i=0;i<6;i++){
+    key = (key ^ address[i]) * 16777619;
+  }
+  for(size_t i=0;i<length;i++){
+    key = (key ^ payload[i]) * 16777619;
+  }
+  key |= 1;  // 0 marks an empty slot
+  uint32_t now = millis();
+  uint32_t index = key & (GATEWAY_DEDUP_SLOTS - 1);
+  for(int probe=0;probe<8;probe++){
+    DedupSlot &slot = gatewayDedup[(index + probe) & (GATEWAY_DEDUP_SLOTS - 1)];
+    bool stale = slot.key == 0 || now - slot.seen > GATEWAY_DEDUP_MS;
+    if(slot.key == key && !stale){
+      slot.seen = now;
+      return true;
+    }
+    if(stale){
+      slot.key = key;
+      slot.seen = now;
+      return false;
+    }
+  }
+  // Neighbourhood full, treat as new
+  return false;
+}
+/********************************************
+ * class name: MyGatewayCallbacks()
+ * inherit: BLEAdvertisedDeviceCallbacks
+ * functions: onResult()
+ * description: Filters and deduplicates
+ * every advert the scanner sees and queues
+ * new ones for the gateway task. Runs in
+ * the BLE host task, so it never blocks.
+ ********************************************/
+class MyGatewayCallbacks: public BLEAdvertisedDeviceCallbacks {
+  void onResult(BLEAdvertisedDevice advertisedDevice){
+    gatewayAdverts++;
+    if(gatewayWhitelist[0] != NULL){
+      std::string address = advertisedDevice.getAddress().toString();
+      bool listed = false;
+      for(int i=0;gatewayWhitelist[i] != NULL && !listed;i++){
+        listed = strncasecmp(address.c_str(), gatewayWhitelist[i], strlen(gatewayWhitelist[i])) == 0;
+      }
+      if(!listed){
+        return;
+      }
+    }
+    GatewayReading reading;
+    memcpy(reading.address, *advertisedDevice.getAddress().getNative(), 6);
+    reading.rssi = advertisedDevice.getRSSI();
+    reading.length = min(advertisedDevice.getPayloadLength(), sizeof(reading.data));
+    memcpy(reading.data, advertisedDevice.getPayload(), reading.length);
+    if(gatewayIsDuplicate(reading.address, reading.data, reading.length)){
+      gatewayDuplicates++;
+      return;
+    }
+    if(xQueueSend(gatewayQueue, &reading, 0) != pdTRUE){
+      gatewayDropped++;
+    }
+  }
+};
+// Bluetooth Config Characteristic callbacks
+/********************************************
+ * class name: MyConfigCallbacks()
+ * inherit: BLECharacteristicCallbacks
+ * functions: onWrite()
+ * description: Takes "key=value" writes for
+ * any setting, e.g. "ble_status=1000".
+ ********************************************/
+class MyConfigCallbacks: public BLECharacteristicCallbacks {
+  void onWrite(BLECharacteristic *configCharacteristic){
+    std::string rxValue = configCharacteristic->getValue();
+    size_t split = rxValue.find('=');
+    bleActivity();
+    // Only the key is logged, the value may be the password
+    std::string key = rxValue.substr(0, split);
+    if(split == std::string::npos || !settingWrite(key.c_str(), rxValue.substr(split + 1).c_str())){
+      logLine("[BLE] Rejected setting %s", key.c_str());
+      return;
     }
-    Serial.print("[BLE] Changed WiFi Password to: ");
-    Serial.print(WIFI_PASSWORD);
-    Serial.println("");
+    bool committed = settingsCommit();
+    logLine("[BLE] Changed setting %s", key.c_str());
+    notifyProvisionStatus("config", committed);
+  }
+};
+// Uplink transports
+/********************************************
+ * class name: UplinkTransport()
+ * functions: send()
+ * description: Interface every uplink sits
+ * behind. send() returns SEND_OK only once
+ * the far end acknowledged the payload, and
+ * SEND_REJECTED when it refused it for good,
+ * so sending it again cannot help.
+ ********************************************/
+enum SendResult { SEND_OK, SEND_RETRY, SEND_REJECTED };
+class UplinkTransport {
+  public:
+    virtual SendResult send(const uint8_t *data, size_t length) = 0;
+};
+/********************************************
+ * name: httpResult()
+ * parameters: code
+ * description: Maps an HTTP status to a send
+ * result. 4xx is the request itself, except
+ * timeout and rate limiting.
+ ********************************************/
+SendResult httpResult(int code){
+  if(code >= 200 && code < 300){
+    return SEND_OK;
+  }
+  if(code >= 400 && code < 500 && code != 408 && code != 429){
+    return SEND_REJECTED;
+  }
+  return SEND_RETRY;
+}
+/********************************************
+ * class name: HttpUplink()
+ * inherit: UplinkTransport
+ * functions: send()
+ * description: POSTs a batch to UPLINK_URL.
+ * A 2xx response counts as the ack.
+ ********************************************/
+class HttpUplink: public UplinkTransport {
+  public:
+    SendResult send(const uint8_t *data, size_t length){
+      // The connection is kept alive between batches
+      http.setReuse(true);
+      if(!http.begin(UPLINK_URL)){
+        return SEND_RETRY;
+      }
+      http.addHeader("Content-Type", "application/octet-stream");
+      int code = http.POST((uint8_t *)data, length);
+      http.end();
+      return httpResult(code);
+    }
+  private:
+    HTTPClient http;
+};
+/********************************************
+ * name: tlsSend(), tlsRecv()
+ * parameters: ctx, buf, len
+ * description: mbedTLS BIO callbacks on top
+ * of a WiFiClient.
+ ********************************************/
+int tlsSend(void *ctx, const unsigned char *buf, size_t len){
+  WiFiClient *client = (WiFiClient *)ctx;
+  if(!client->connected()){
+    return MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  int sent = client->write(buf, len);
+  return sent > 0 ? sent : MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+int tlsRecv(void *ctx, unsigned char *buf, size_t len){
+  WiFiClient *client = (WiFiClient *)ctx;
+  if(client->available() == 0){
+    return client->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  return client->read(buf, len);
+}
+/********************************************
+ * class name: HttpsUplink()
+ * inherit: UplinkTransport
+ * functions: send()
+ * description: HTTPS POST to UPLINK_HOST on
+ * mbedTLS. The TLS connection is kept alive
+ * across batches and the last session is
+ * cached in RTC RAM, so a reconnect after
+ * WiFi drops or a reboot is an abbreviated
+ * handshake instead of a full one. AES/SHA/
+ * bignum run on the ESP32 crypto hardware
+ * (CONFIG_MBEDTLS_HARDWARE_*), so suites are
+ * limited to ones it accelerates.
+ ********************************************/
+class HttpsUplink: public UplinkTransport {
+  public:
+    SendResult send(const uint8_t *data, size_t length){
+      if(!initialized && !init()){
+        return SEND_RETRY;
+      }
+      // A kept-alive connection may have been closed by the server
+      for(int attempt=0;attempt<2;attempt++){
+        if(!connected && !connect()){
+          return SEND_RETRY;
+        }
+        int code = post(data, length);
+        if(code > 0){
+          return httpResult(code);
+        }
+        close();
+      }
+      return SEND_RETRY;
+    }
+  private:
+    WiFiClient tcp;
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_entropy_context entropy;
+    mbedtls_x509_crt ca;
+    bool initialized = false;
+    bool connected = false;
+
+    bool init(){
+      static const int ciphersuites[] = {
+        MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+        MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+        0
+      };
+      mbedtls_ssl_init(&ssl);
+      mbedtls_ssl_config_init(&conf);
+      mbedtls_ctr_drbg_init(&drbg);
+      mbedtls_entropy_init(&entropy);
+      mbedtls_x509_crt_init(&ca);
+      if(mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, NULL, 0) != 0 ||
+         mbedtls_x509_crt_parse(&ca, (const unsigned char *)UPLINK_CA_CERT, sizeof(UPLINK_CA_CERT)) != 0 ||
+         mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0){
+        logLine("[TLS] Init failed");
+        release();
+        return false;
+      }
+      mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+      mbedtls_ssl_conf_ca_chain(&conf, &ca, NULL);
+      mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &drbg);
+      mbedtls_ssl_conf_ciphersuites(&conf, ciphersuites);
+      mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+      if(mbedtls_ssl_setup(&ssl, &conf) != 0 || mbedtls_ssl_set_hostname(&ssl, UPLINK_HOST) != 0){
+        logLine("[TLS] Init failed");
+        release();
+        return false;
+      }
+      mbedtls_ssl_set_bio(&ssl, &tcp, tlsSend, tlsRecv, NULL);
+      initialized = true;
+      return true;
+    }
+
+    // Frees what init() set up, so the next send can init again
+    void release(){
+      mbedtls_ssl_free(&ssl);
+      mbedtls_ssl_config_free(&conf);
+      mbedtls_ctr_drbg_free(&drbg);
+      mbedtls_entropy_free(&entropy);
+      mbedtls_x509_crt_free(&ca);
+    }
+
+    bool connect(){
+      if(!tcp.connect(UPLINK_HOST, UPLINK_PORT)){
+        return false;
+      }
+      mbedtls_ssl_session_reset(&ssl);
+      // The server echoes the offered session ID only when it resumes
+      unsigned char offeredId[32];
+      size_t offeredIdLength = 0;
+      if(tlsSessionMagic == TLS_SESSION_MAGIC && tlsSessionLength <= TLS_SESSION_SIZE){
+        mbedtls_ssl_session session;
+        mbedtls_ssl_session_init(&session);
+        if(mbedtls_ssl_session_load(&session, tlsSessionCache, tlsSessionLength) == 0 &&
+           mbedtls_ssl_set_session(&ssl, &session) == 0){
+          offeredIdLength = min(session.id_len, sizeof(offeredId));
+          memcpy(offeredId, session.id, offeredIdLength);
+        }
+        mbedtls_ssl_session_free(&session);
+      }
+      unsigned long start = millis();
+      int ret;
+      powerBoostBegin(BOOST_CRYPTO);
+      while((ret = mbedtls_ssl_handshake(&ssl)) != 0){
+        if((ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) || millis() - start > TLS_TIMEOUT_MS){
+          powerBoostEnd(BOOST_CRYPTO);
+          logLine("[TLS] Handshake failed: -0x%04x", -ret);
+          // A stale cached session must not block the next attempt
+          tlsSessionMagic = 0;
+          tcp.stop();
+          return false;
+        }
+        vTaskDelay(1);
+      }
+      powerBoostEnd(BOOST_CRYPTO);
+      tlsHandshakes++;
+      tlsHandshakeMs += millis() - start;
+      // Cache the session (and any ticket) for the next connect
+      mbedtls_ssl_session session;
+      mbedtls_ssl_session_init(&session);
+      size_t sessionLength = 0;
+      bool resumed = false;
+      if(mbedtls_ssl_get_session(&ssl, &session) == 0){
+        resumed = offeredIdLength > 0 && session.id_len == offeredIdLength &&
+                  memcmp(session.id, offeredId, offeredIdLength) == 0;
+        ret = mbedtls_ssl_session_save(&session, tlsSessionCache, TLS_SESSION_SIZE, &sessionLength);
+        if(ret == 0){
+          tlsSessionLength = sessionLength;
+          tlsSessionMagic = TLS_SESSION_MAGIC;
+        }
+        else{
+          // Usually the kept peer certificate; CONFIG_MBEDTLS_SSL_KEEP_PEER_CERTIFICATE=n fixes it
+          logLine("[TLS] Session not cached: -0x%04x, needs %u of %u bytes", -ret, (unsigned)sessionLength,
+                  TLS_SESSION_SIZE);
+          tlsSessionMagic = 0;
+        }
+      }
+      mbedtls_ssl_session_free(&session);
+      logLine("[TLS] Handshake %lu took %lu ms (%s), total %lu ms", tlsHandshakes, millis() - start,
+              resumed ? "resumed" : offeredIdLength > 0 ? "resume refused" : "full", tlsHandshakeMs);
+      connected = true;
+      return true;
+    }
+
+    void close(){
+      if(connected){
+        mbedtls_ssl_close_notify(&ssl);
+      }
+      tcp.stop();
+      connected = false;
+    }
+
+    bool writeAll(const uint8_t *data, size_t length){
+      unsigned long start = millis();
+      while(length > 0){
+        int ret = mbedtls_ssl_write(&ssl, data, length);
+        if(ret > 0){
+          data += ret;
+          length -= ret;
+        }
+        else if((ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) || millis() - start > TLS_TIMEOUT_MS){
+          return false;
+        }
+        else{
+          vTaskDelay(1);
+        }
+      }
+      return true;
+    }
+
+    int readLine(char *line, size_t size){
+      unsigned long start = millis();
+      size_t length = 0;
+      while(millis() - start < TLS_TIMEOUT_MS){
+        unsigned char c;
+        int ret = mbedtls_ssl_read(&ssl, &c, 1);
+        if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE){
+          vTaskDelay(1);
+          continue;
+        }
+        if(ret <= 0){
+          return -1;
+        }
+        if(c == '\n'){
+          line[length] = 0;
+          return length;
+        }
+        if(c != '\r' && length < size - 1){
+          line[length++] = c;
+        }
+      }
+      return -1;
+    }
+
+    /********************************************
+     * name: post()
+     * parameters: data, length
+     * description: One keep-alive request.
+     * Returns the HTTP status, or -1 when the
+     * connection is unusable.
+     ********************************************/
+    int post(const uint8_t *data, size_t length){
+      char line[128];
+      snprintf(line, sizeof(line), "POST %s HTTP/1.1\r\nHost: %s\r\n", UPLINK_PATH, UPLINK_HOST);
+      if(!writeAll((const uint8_t *)line, strlen(line))){
+        return -1;
+      }
+      snprintf(line, sizeof(line), "Content-Type: application/octet-stream\r\nContent-Length: %u\r\n\r\n", (unsigned)length);
+      if(!writeAll((const uint8_t *)line, strlen(line)) || !writeAll(data, length)){
+        return -1;
+      }
+      if(readLine(line, sizeof(line)) < 12 || strncmp(line, "HTTP/1.", 7) != 0){
+        return -1;
+      }
+      int code = atoi(line + 9);
+      long contentLength = 0;
+      bool keepAlive = true;
+      bool chunked = false;
+      while(readLine(line, sizeof(line)) > 0){
+        if(strncasecmp(line, "Content-Length:", 15) == 0){
+          contentLength = atol(line + 15);
+        }
+        else if(strncasecmp(line, "Transfer-Encoding:", 18) == 0){
+          chunked = strcasestr(line + 18, "chunked") != NULL;
+        }
+        else if(strncasecmp(line, "Connection: close", 17) == 0){
+          keepAlive = false;
+        }
+      }
+      // Skip the body so the next response starts clean
+      if(chunked){
+        for(;;){
+          if(readLine(line, sizeof(line)) < 0){
+            keepAlive = false;
+            break;
+          }
+          long chunk = strtol(line, NULL, 16);
+          if(chunk <= 0){
+            // Trailer fields up to the empty line
+            int ret;
+            while((ret = readLine(line, sizeof(line))) > 0){
+            }
+            keepAlive &= ret == 0 && chunk == 0;
+            break;
+          }
+          // Chunk data and its CRLF
+          if(!skip(chunk) || readLine(line, sizeof(line)) != 0){
+            keepAlive = false;
+            break;
+          }
+        }
+      }
+      else if(!skip(contentLength)){
+        keepAlive = false;
+      }
+      if(!keepAlive){
+        close();
+      }
+      return code;
+    }
+
+    bool skip(long length){
+      unsigned char body[64];
+      unsigned long start = millis();
+      while(length > 0){
+        int ret = mbedtls_ssl_read(&ssl, body, min((long)sizeof(body), length));
+        if(ret > 0){
+          length -= ret;
+        }
+        else if((ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) || millis() - start > TLS_TIMEOUT_MS){
+          return false;
+        }
+        else{
+          vTaskDelay(1);
+        }
+      }
+      return true;
+    }
+};
+/********************************************
+ * class name: CoapUplink()
+ * inherit: UplinkTransport
+ * functions: send()
+ * description: CoAP POST to COAP_HOST over
+ * UDP (RFC 7252). No connection setup, so it
+ * can send the moment WiFi has an IP.
+ * Payloads larger than one block go out
+ * block-wise with Block1 (RFC 7959).
+ * Confirmable messages are retransmitted
+ * with exponential backoff until ACKed. A
+ * Reset or a 4.xx response rejects the
+ * message.
+ ********************************************/
+class CoapUplink: public UplinkTransport {
+  public:
+    SendResult send(const uint8_t *data, size_t length){
+      if(!started){
+        udp.begin(COAP_PORT);
+        messageId = esp_random();
+        started = true;
+      }
+      const size_t blockSize = 16 << COAP_BLOCK_SZX;
+      bool blockwise = length > blockSize;
+      for(size_t offset=0, number=0;offset<length || number==0;offset+=blockSize, number++){
+        size_t chunk = min(blockSize, length - offset);
+        bool more = offset + chunk < length;
+        SendResult result = exchange(data + offset, chunk, blockwise, number, more);
+        if(result != SEND_OK){
+          return result;
+        }
+      }
+      return SEND_OK;
+    }
+  private:
+    WiFiUDP udp;
+    bool started = false;
+    uint16_t messageId;
+    uint8_t packet[32 + (16 << COAP_BLOCK_SZX)];
+
+    static void putOption(uint8_t *packet, size_t &pos, uint16_t &last, uint16_t number, const uint8_t *value, size_t length){
+      // Small deltas/lengths only, enough for our options
+      uint16_t delta = number - last;
+      last = number;
+      if(delta >= 13){
+        packet[pos++] = (13 << 4) | length;
+        packet[pos++] = delta - 13;
+      }
+      else{
+        packet[pos++] = (delta << 4) | length;
+      }
+      memcpy(packet + pos, value, length);
+      pos += length;
+    }
+
+    /********************************************
+     * name: exchange()
+     * parameters: data, length, blockwise,
+     * number, more
+     * description: Sends one POST (or block)
+     * and waits for its ACK and 2.xx response.
+     ********************************************/
+    SendResult exchange(const uint8_t *data, size_t length, bool blockwise, size_t number, bool more){
+      size_t pos = 0;
+      uint16_t last = 0;
+      uint16_t id = ++messageId;
+      uint16_t token = esp_random();
+      packet[pos++] = 0x40 | ((COAP_CONFIRMABLE ? 0 : 1) << 4) | 2;  // Ver 1, CON/NON, TKL 2
+      packet[pos++] = 0x02;                                            // POST
+      packet[pos++] = id >> 8;
+      packet[pos++] = id & 0xFF;
+      packet[pos++] = token >> 8;
+      packet[pos++] = token & 0xFF;
+      putOption(packet, pos, last, 11, (const uint8_t *)COAP_PATH, strlen(COAP_PATH));   // Uri-Path
+      uint8_t format = 42;                                             // application/octet-stream
+      putOption(packet, pos, last, 12, &format, 1);
+      if(blockwise){
+        uint32_t block = (number << 4) | (more ? 0x08 : 0) | COAP_BLOCK_SZX;
+        uint8_t value[3] = {(uint8_t)(block >> 16), (uint8_t)(block >> 8), (uint8_t)block};
+        size_t valueLength = block > 0xFFFF ? 3 : block > 0xFF ? 2 : 1;
+        putOption(packet, pos, last, 27, value + 3 - valueLength, valueLength);  // Block1
+      }
+      packet[pos++] = 0xFF;
+      memcpy(packet + pos, data, length);
+      pos += length;
+      unsigned long timeout = COAP_ACK_TIMEOUT_MS + esp_random() % (COAP_ACK_TIMEOUT_MS / 2);
+      bool acknowledged = false;
+      for(int attempt=0;attempt<=COAP_MAX_RETRANSMIT;attempt++){
+        udp.beginPacket(COAP_HOST, COAP_PORT);
+        udp.write(packet, pos);
+        udp.endPacket();
+        if(!COAP_CONFIRMABLE){
+          // NON opts out of at-least-once delivery: the message is
+          // handed to the network and leaves the retry queue here
+          return SEND_OK;
+        }
+        unsigned long start = millis();
+        while(millis() - start < timeout){
+          uint8_t response[16];
+          if(udp.parsePacket() == 0){
+            vTaskDelay(1);
+            continue;
+          }
+          int received = udp.read(response, sizeof(response));
+          udp.flush();
+          if(received < 4){
+            continue;
+          }
+          uint8_t type = (response[0] >> 4) & 0x03;
+          if(type == 3 && response[2] == (id >> 8) && response[3] == (id & 0xFF)){
+            // RST: the server rejected the message, retransmitting won't help
+            logLine("[COAP] Reset by server");
+            return SEND_REJECTED;
+          }
+          bool ourAck = type == 2 && response[2] == (id >> 8) && response[3] == (id & 0xFF);
+          if(ourAck && response[1] == 0){
+            // Empty ACK: stop retransmitting, the response follows separately
+            acknowledged = true;
+            start = millis();
+            continue;
+          }
+          bool ourToken = received >= 6 && (response[0] & 0x0F) == 2 &&
+                          response[4] == (token >> 8) && response[5] == (token & 0xFF);
+          if(!ourAck && !ourToken){
+            continue;
+          }
+          if(type == 0){
+            // Separate CON response: acknowledge it
+            uint8_t ack[4] = {0x60, 0x00, response[2], response[3]};
+            udp.beginPacket(COAP_HOST, COAP_PORT);
+            udp.write(ack, sizeof(ack));
+            udp.endPacket();
+          }
+          uint8_t responseClass = response[1] >> 5;
+          return responseClass == 2 ? SEND_OK : responseClass == 4 ? SEND_REJECTED : SEND_RETRY;
+        }
+        if(acknowledged){
+          return SEND_RETRY;
+        }
+        timeout *= 2;
+      }
+      return SEND_RETRY;
+    }
+};
+/********************************************
+ * name: espNowReceived()
+ * parameters: mac, data, length
+ * description: A complete message from a
+ * neighbouring device, delivered on the
+ * uplink task. Hook application handling
+ * in here.
+ ********************************************/
+void espNowReceived(const uint8_t *mac, const uint8_t *data, size_t length){
+  logLine("[ESPNOW] %u bytes from %02x:%02x:%02x:%02x:%02x:%02x", (unsigned)length,
+          mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+/********************************************
+ * class name: EspNowUplink()
+ * inherit: UplinkTransport
+ * functions: send()
+ * description: ESP-NOW link to ESPNOW_PEER.
+ * Messages are split into fragments of one
+ * action frame each; every fragment must be
+ * ACKed by the peer's MAC or it is retried.
+ * The peer is added on channel 0, so it
+ * follows whatever channel the STA uses and
+ * keeps working next to the AP connection.
+ * Broadcast is never ACKed, so a link
+ * without a unicast peer refuses to start.
+ * Received messages are queued by the WiFi
+ * task and handled in poll().
+ ********************************************/
+class EspNowUplink: public UplinkTransport {
+  public:
+    SendResult send(const uint8_t *data, size_t length){
+      if(!begin()){
+        return SEND_RETRY;
+      }
+      uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+      uint8_t count = (length + ESPNOW_FRAGMENT - 1) / ESPNOW_FRAGMENT;
+      sequence++;
+      for(uint8_t index=0;index<count || index==0;index++){
+        size_t offset = index * ESPNOW_FRAGMENT;
+        size_t chunk = min((size_t)ESPNOW_FRAGMENT, length - offset);
+        frame[0] = sequence & 0xFF;
+        frame[1] = sequence >> 8;
+        frame[2] = index;
+        frame[3] = count;
+        memcpy(frame + ESPNOW_HEADER, data + offset, chunk);
+        if(!sendFrame(frame, chunk + ESPNOW_HEADER)){
+          return SEND_RETRY;
+        }
+      }
+      return SEND_OK;
+    }
+
+    // Needs the WiFi driver running; safe to call repeatedly
+    bool begin(){
+      if(started){
+        return true;
+      }
+      const uint8_t address[6] = ESPNOW_PEER;
+      if(address[0] & 0x01){
+        // Broadcast/multicast "succeeds" without anyone receiving it
+        static bool warned = false;
+        if(!warned){
+          logLine("[ESPNOW] ESPNOW_PEER is not a unicast address, set the peer's STA MAC");
+          warned = true;
+        }
+        return false;
+      }
+      if(WiFi.getMode() == WIFI_OFF || esp_now_init() != ESP_OK){
+        return false;
+      }
+      sent = xSemaphoreCreateBinary();
+      received = xQueueCreate(ESPNOW_RX_QUEUE, sizeof(EspNowMessage));
+      esp_now_register_send_cb(onSent);
+      esp_now_register_recv_cb(onReceive);
+      esp_now_peer_info_t peer = {};
+      memcpy(peer.peer_addr, address, 6);
+      peer.channel = 0;
+      peer.ifidx = WIFI_IF_STA;
+      peer.encrypt = false;
+      if(esp_now_add_peer(&peer) != ESP_OK){
+        return false;
+      }
+      started = true;
+      return true;
+    }
+
+    // Hands queued messages to espNowReceived() outside the WiFi task
+    static void poll(){
+      static EspNowMessage message;
+      while(received != NULL && xQueueReceive(received, &message, 0) == pdTRUE){
+        espNowReceived(message.mac, message.data, message.length);
+      }
+      if(rxDropped > 0){
+        logLine("[ESPNOW] %lu received messages dropped, queue full", rxDropped);
+        rxDropped = 0;
+      }
+    }
+  private:
+    struct EspNowMessage {
+      uint8_t mac[6];
+      uint16_t length;
+      uint8_t data[UPLINK_BUFFER_SIZE + 1];
+    };
+    bool started = false;
+    uint16_t sequence = 0;
+    static SemaphoreHandle_t sent;
+    static bool delivered;
+    static QueueHandle_t received;
+    static EspNowMessage rx;
+    static uint16_t rxSequence;
+    static uint8_t rxNext;
+    static volatile unsigned long rxDropped;
+
+    bool sendFrame(const uint8_t *frame, size_t length){
+      const uint8_t address[6] = ESPNOW_PEER;
+      for(int attempt=0;attempt<=ESPNOW_RETRIES;attempt++){
+        xSemaphoreTake(sent, 0);
+        if(esp_now_send(address, frame, length) == ESP_OK &&
+           xSemaphoreTake(sent, ESPNOW_ACK_MS / portTICK_PERIOD_MS) == pdTRUE && delivered){
+          return true;
+        }
+      }
+      return false;
+    }
+
+    static void onSent(const uint8_t *mac, esp_now_send_status_t status){
+      delivered = status == ESP_NOW_SEND_SUCCESS;
+      xSemaphoreGive(sent);
+    }
+
+    // Reassembles in-order fragments from the peer
+    static void onReceive(const uint8_t *mac, const uint8_t *data, int length){
+      if(length < ESPNOW_HEADER){
+        return;
+      }
+      uint16_t sequence = data[0] | data[1] << 8;
+      uint8_t index = data[2];
+      uint8_t count = data[3];
+      if(index == 0){
+        rxSequence = sequence;
+        rx.length = 0;
+        rxNext = 0;
+      }
+      if(sequence != rxSequence || index != rxNext || rx.length + length - ESPNOW_HEADER > sizeof(rx.data)){
+        // Lost or repeated fragment, wait for the next message
+        return;
+      }
+      memcpy(rx.data + rx.length, data + ESPNOW_HEADER, length - ESPNOW_HEADER);
+      rx.length += length - ESPNOW_HEADER;
+      rxNext++;
+      if(rxNext >= count){
+        // Runs in the WiFi task: queue it instead of handling it here
+        memcpy(rx.mac, mac, 6);
+        if(xQueueSend(received, &rx, 0) == pdTRUE){
+          xTaskNotifyGive(uplinkTaskHandle);
+        }
+        else{
+          rxDropped++;
+        }
+        rxNext = 0xFF;
+      }
+    }
+};
+SemaphoreHandle_t EspNowUplink::sent;
+bool EspNowUplink::delivered;
+QueueHandle_t EspNowUplink::received = NULL;
+EspNowUplink::EspNowMessage EspNowUplink::rx;
+uint16_t EspNowUplink::rxSequence;
+uint8_t EspNowUplink::rxNext;
+volatile unsigned long EspNowUplink::rxDropped = 0;
+#if UPLINK_TRANSPORT == UPLINK_HTTPS
+HttpsUplink httpsUplink;
+UplinkTransport *uplink = &httpsUplink;
+#elif UPLINK_TRANSPORT == UPLINK_COAP
+CoapUplink coapUplink;
+UplinkTransport *uplink = &coapUplink;
+#elif UPLINK_TRANSPORT == UPLINK_ESPNOW
+EspNowUplink espNowUplink;
+UplinkTransport *uplink = &espNowUplink;
+#else
+HttpUplink httpUplink;
+UplinkTransport *uplink = &httpUplink;
+#endif
+UplinkTransport *directUplink = uplink;
+/********************************************
+ * class name: MeshUplink()
+ * inherit: UplinkTransport
+ * functions: send()
+ * description: Hands a message to the mesh
+ * parent (our gateway on its soft AP). The
+ * parent ACKs once it has queued the frame
+ * for forwarding; no ACK means its queue is
+ * full or the frame was lost, so we retry.
+ ********************************************/
+class MeshUplink: public UplinkTransport {
+  public:
+    SendResult send(const uint8_t *data, size_t length){
+      uint8_t frame[MESH_FRAME_SIZE];
+      if(length > sizeof(frame) - MESH_HEADER){
+        // Would never fit, retrying it would block the uplink for good
+        meshOversize++;
+        return SEND_REJECTED;
+      }
+      uint32_t origin = ESP.getEfuseMac() & 0xFFFFFFFF;
+      sequence++;
+      memcpy(frame, &origin, 4);
+      frame[4] = meshHops;
+      frame[5] = sequence & 0xFF;
+      frame[6] = sequence >> 8;
+      memcpy(frame + MESH_HEADER, data, length);
+      for(int attempt=0;attempt<3;attempt++){
+        meshUdp.beginPacket(WiFi.gatewayIP(), MESH_PORT);
+        meshUdp.write(frame, length + MESH_HEADER);
+        meshUdp.endPacket();
+        unsigned long start = millis();
+        while(millis() - start < MESH_ACK_MS){
+          if(meshAck == sequence){
+            return SEND_OK;
+          }
+          vTaskDelay(5 / portTICK_PERIOD_MS);
+        }
+      }
+      return SEND_RETRY;
+    }
+    // Set by meshTask when the parent ACKs
+    volatile uint16_t meshAck = 0;
+  private:
+    uint16_t sequence = 0;
+};
+MeshUplink meshUplink;
+// Mesh functions
+/********************************************
+ * name: meshPrepareAP()
+ * parameters: none
+ * description: Switches to AP+STA with the
+ * soft AP already hidden and locked with
+ * MESH_PASSWORD. Switching the mode on a
+ * running driver would beacon the default
+ * open ESP_xxxx AP until meshStartAP(), so
+ * the config goes in while it is stopped.
+ ********************************************/
+void meshPrepareAP(){
+  WiFi.mode(WIFI_STA);
+  esp_wifi_stop();
+  esp_wifi_set_mode(WIFI_MODE_APSTA);
+  wifi_config_t config = {};
+  strncpy((char *)config.ap.ssid, MESH_PREFIX, sizeof(config.ap.ssid));
+  config.ap.ssid_len = strlen(MESH_PREFIX);
+  strncpy((char *)config.ap.password, MESH_PASSWORD, sizeof(config.ap.password) - 1);
+  config.ap.authmode = WIFI_AUTH_WPA2_PSK;
+  config.ap.ssid_hidden = 1;
+  config.ap.max_connection = 4;
+  config.ap.beacon_interval = 100;
+  esp_wifi_set_config(WIFI_IF_AP, &config);
+  esp_wifi_start();
+}
+/********************************************
+ * name: meshStartAP()
+ * parameters: none
+ * description: Offers our connection to
+ * out-of-range neighbours. The SSID carries
+ * our hop count; each node uses its own
+ * 10.<hops>.<id>.0/24 subnet.
+ ********************************************/
+void meshStartAP(){
+  char ssid[32];
+  uint8_t id = ESP.getEfuseMac() >> 40;
+  snprintf(ssid, sizeof(ssid), "%s%u-%06x", MESH_PREFIX, meshHops, (unsigned)(ESP.getEfuseMac() >> 24) & 0xFFFFFF);
+  IPAddress address(10, meshHops, id, 1);
+  WiFi.softAPConfig(address, address, IPAddress(255, 255, 255, 0));
+  WiFi.softAP(ssid, MESH_PASSWORD);
+  logLine("[MESH] Relaying as %s", ssid);
+}
+/********************************************
+ * name: meshJoin()
+ * parameters: none
+ * description: Picks the best mesh parent in
+ * range by RSSI minus MESH_HOP_PENALTY per
+ * hop and joins it. Uplink traffic then goes
+ * through the parent.
+ ********************************************/
+bool meshJoin(){
+  int count = WiFi.scanNetworks();
+  int best = -1;
+  int bestHops = 0;
+  int bestMetric = -1000;
+  for(int i=0;i<count;i++){
+    unsigned hops;
+    if(sscanf(WiFi.SSID(i).c_str(), MESH_PREFIX "%u-", &hops) != 1 || hops == 0 || hops >= MESH_MAX_HOPS){
+      continue;
+    }
+    int metric = WiFi.RSSI(i) - MESH_HOP_PENALTY * hops;
+    if(metric > bestMetric){
+      best = i;
+      bestHops = hops;
+      bestMetric = metric;
+    }
+  }
+  if(best < 0){
+    WiFi.scanDelete();
+    return false;
+  }
+  String ssid = WiFi.SSID(best);
+  WiFi.scanDelete();
+  logLine("[MESH] Joining %s", ssid.c_str());
+  WiFi.begin(ssid.c_str(), MESH_PASSWORD);
+  unsigned long start = millis();
+  while(WiFi.status() != WL_CONNECTED && millis() - start < WIFI_TIMEOUT_MS){
+    vTaskDelay(100 / portTICK_PERIOD_MS);
+  }
+  if(WiFi.status() != WL_CONNECTED){
+    return false;
+  }
+  meshHops = bestHops + 1;
+  uplink = &meshUplink;
+  meshStartAP();
+  return true;
+}
+/********************************************
+ * name: meshNoteDescendant()
+ * parameters: origin, via, hops
+ * description: Remembers which child a node
+ * was last heard through, for the report;
+ * the oldest entry is replaced when the
+ * table is full.
+ ********************************************/
+void meshNoteDescendant(uint32_t origin, IPAddress via, uint8_t hops){
+  int slot = 0;
+  for(int i=0;i<MESH_DESCENDANTS;i++){
+    if(meshDescendants[i].origin == origin){
+      slot = i;
+      break;
+    }
+    if(meshDescendants[i].lastSeen < meshDescendants[slot].lastSeen){
+      slot = i;
+    }
+  }
+  meshDescendants[slot].origin = origin;
+  meshDescendants[slot].via = via;
+  meshDescendants[slot].hops = hops;
+  meshDescendants[slot].lastSeen = millis();
+}
+// Uplink functions
+/********************************************
+ * name: lzCompress()
+ * parameters: in, inLength, out, outSize
+ * description: LZSS compressor in the style
+ * of heatshrink. Every flag byte describes
+ * the next 8 items: a literal byte, or a
+ * 2-byte match (12-bit distance, 4-bit
+ * length + 3). Returns the compressed size
+ * or 0 when it does not fit in out.
+ ********************************************/
+size_t lzCompress(const uint8_t *in, size_t inLength, uint8_t *out, size_t outSize){
+  uint16_t head[256];               // Per call, the uplink and storage tasks both compress
+  size_t inPos = 0;
+  size_t outPos = 0;
+  size_t flagPos = 0;
+  uint8_t flagBit = 8;
+  memset(head, 0xFF, sizeof(head));
+  while(inPos < inLength){
+    if(flagBit == 8){
+      if(outPos >= outSize){
+        return 0;
+      }
+      flagPos = outPos++;
+      out[flagPos] = 0;
+      flagBit = 0;
+    }
+    size_t matchLength = 0;
+    size_t distance = 0;
+    if(inPos + 3 <= inLength){
+      uint8_t hash = (in[inPos] * 33) ^ (in[inPos+1] * 7) ^ in[inPos+2];
+      uint16_t candidate = head[hash];
+      head[hash] = inPos;
+      if(candidate != 0xFFFF && inPos - candidate <= 0xFFF){
+        size_t maxLength = min((size_t)18, inLength - inPos);
+        while(matchLength < maxLength && in[candidate+matchLength] == in[inPos+matchLength]){
+          matchLength++;
+        }
+        distance = inPos - candidate;
+      }
+    }
+    if(matchLength >= 3){
+      if(outPos + 2 > outSize){
+        return 0;
+      }
+      out[flagPos] |= 1 << flagBit;
+      out[outPos++] = (distance >> 4) & 0xFF;
+      out[outPos++] = ((distance & 0x0F) << 4) | (matchLength - 3);
+      inPos += matchLength;
+    }
+    else{
+      if(outPos >= outSize){
+        return 0;
+      }
+      out[outPos++] = in[inPos++];
+    }
+    flagBit++;
+  }
+  return outPos;
+}
+/********************************************
+ * name: adaptBatchSize()
+ * parameters: none
+ * description: Picks how many records go in
+ * the next batch. Weak links and an
+ * overspent radio budget mean bigger, rarer
+ * batches; otherwise shrink for latency.
+ ********************************************/
+void adaptBatchSize(){
+  unsigned long elapsed = millis() - radioWindowStart;
+  if(elapsed > 3600000){
+    // Start a new budget hour; radioOnMs itself keeps counting for txPowerAdapt()
+    radioWindowStart = millis();
+    radioWindowOnMs = radioOnMs;
+    elapsed = 1;
+  }
+  unsigned long allowed = (unsigned long)((uint64_t)RADIO_BUDGET_MS * elapsed / 3600000) + 1;
+  unsigned long used = radioOnMs - radioWindowOnMs;
+  if(used > allowed){
+    batchRecords *= 2;
+  }
+  else if(used < allowed / 2){
+    batchRecords /= 2;
+  }
+  int minimum = BATCH_MIN_RECORDS;
+  int rssi = WiFi.RSSI();
+  if(rssi < -75){
+    minimum *= 4;
+  }
+  else if(rssi < -65){
+    minimum *= 2;
+  }
+  batchRecords = constrain(batchRecords, minimum, BATCH_MAX_RECORDS);
+}
+/********************************************
+ * name: publishMessage()
+ * parameters: messageClass, data, length
+ * description: Queues a message for the
+ * uplink under its priority class. When the
+ * class queue is full its drop policy
+ * decides which message is discarded.
+ * Returns false if this message was dropped.
+ ********************************************/
+bool publishMessage(uint8_t messageClass, const uint8_t *data, size_t length){
+  OutboundMessage message;
+  // First byte on the wire tells the backend the class
+  message.data = (uint8_t *)malloc(length + 1);
+  if(message.data == NULL){
+    return false;
+  }
+  message.data[0] = messageClass;
+  memcpy(message.data + 1, data, length);
+  message.length = length + 1;
+  message.messageClass = messageClass;
+  message.created = millis();
+  QueueHandle_t queue = classQueues[messageClass];
+  if(xQueueSend(queue, &message, 0) != pdTRUE){
+    classDropped[messageClass]++;
+    OutboundMessage oldest;
+    if(classConfig[messageClass].dropPolicy == DROP_NEWEST || xQueueReceive(queue, &oldest, 0) != pdTRUE){
+      free(message.data);
+      return false;
+    }
+    free(oldest.data);
+    if(xQueueSend(queue, &message, 0) != pdTRUE){
+      free(message.data);
+      return false;
+    }
+  }
+  if(uplinkTaskHandle != NULL){
+    xTaskNotifyGive(uplinkTaskHandle);
+  }
+  return true;
+}
+/********************************************
+ * name: nextMessage()
+ * parameters: *message
+ * description: Deficit round robin over the
+ * class queues. Each visit tops a class up
+ * by its weight times DRR_QUANTUM bytes, so
+ * alarms get through within a few messages
+ * even behind a large telemetry backlog.
+ ********************************************/
+bool nextMessage(OutboundMessage *message){
+  static int drrDeficit[CLASS_COUNT];
+  static int drrClass = 0;
+  bool pending = false;
+  for(int i=0;i<CLASS_COUNT;i++){
+    if(uxQueueMessagesWaiting(classQueues[i]) > 0){
+      pending = true;
+    }
+  }
+  if(!pending){
+    return false;
+  }
+  for(int visits=0;visits<CLASS_COUNT*8;visits++){
+    OutboundMessage head;
+    if(xQueuePeek(classQueues[drrClass], &head, 0) != pdTRUE){
+      // Idle classes do not bank credit
+      drrDeficit[drrClass] = 0;
+    }
+    else if(drrDeficit[drrClass] >= head.length){
+      if(xQueueReceive(classQueues[drrClass], message, 0) == pdTRUE){
+        drrDeficit[drrClass] -= message->length;
+        return true;
+      }
+    }
+    else{
+      drrDeficit[drrClass] += DRR_QUANTUM * classConfig[drrClass].weight;
+    }
+    drrClass = (drrClass + 1) % CLASS_COUNT;
+  }
+  return false;
+}
+/********************************************
+ * name: buildTelemetryBatch()
+ * parameters: none
+ * description: Once a batch is full or its
+ * oldest record is stale, compresses the
+ * records into a fixed buffer and publishes
+ * it as one telemetry message.
+ ********************************************/
+void buildTelemetryBatch(){
+  static TelemetryRecord batch[BATCH_MAX_RECORDS];
+  static uint8_t buffer[UPLINK_BUFFER_SIZE];
+  static uint32_t sequence = 0;
+  TelemetryRecord oldest;
+  if(xQueuePeek(telemetryQueue, &oldest, 0) != pdTRUE){
+    return;
+  }
+  // Wait for a full batch unless the oldest record is getting stale
+  if((int)uxQueueMessagesWaiting(telemetryQueue) < batchRecords && millis() - oldest.timestamp < BATCH_MAX_AGE_MS){
+    return;
+  }
+  int batchCount = 0;
+  while(batchCount < batchRecords && xQueueReceive(telemetryQueue, &batch[batchCount], 0) == pdTRUE){
+    batchCount++;
+  }
+  sequence++;
+  // Header: type, sequence, record count, raw length
+  uint16_t rawLength = batchCount * sizeof(TelemetryRecord);
+  buffer[0] = TELEMETRY_BATCH;
+  memcpy(buffer + 1, &sequence, 4);
+  buffer[5] = batchCount;
+  memcpy(buffer + 6, &rawLength, 2);
+  size_t length = lzCompress((uint8_t *)batch, rawLength, buffer + 8, sizeof(buffer) - 8);
+  if(length == 0){
+    logLine("[UPLINK] Batch does not fit, dropped");
+    return;
+  }
+  publishMessage(CLASS_TELEMETRY, buffer, length + 8);
+}
+// WebSocket functions
+/********************************************
+ * name: wsAccept()
+ * parameters: client
+ * description: Gives a new connection a slot.
+ * The upgrade request is read by
+ * wsHandshake() as it arrives, so a slow
+ * client never stalls the other streams.
+ ********************************************/
+void wsAccept(WiFiClient client){
+  for(int i=0;i<WS_MAX_CLIENTS;i++){
+    WsClient &ws = wsClients[i];
+    if(ws.state == WS_FREE){
+      ws.client = client;
+      ws.state = WS_HANDSHAKE;
+      ws.since = millis();
+      ws.lineLength = 0;
+      ws.key[0] = 0;
+      return;
+    }
+  }
+  client.print("HTTP/1.1 503 Service Unavailable\r\n\r\n");
+  client.stop();
+}
+/********************************************
+ * name: wsHandshake()
+ * parameters: &ws, slot
+ * description: Consumes whatever part of the
+ * upgrade request has arrived. On the empty
+ * line ending it, answers 101 and starts the
+ * stream at the oldest data still in the
+ * log ring.
+ ********************************************/
+void wsHandshake(WsClient &ws, int slot){
+  if(!ws.client.connected() || millis() - ws.since > WS_HANDSHAKE_MS){
+    ws.client.stop();
+    ws.state = WS_FREE;
+    return;
+  }
+  while(ws.client.available() > 0){
+    char c = ws.client.read();
+    if(c != '\n'){
+      if(c != '\r' && ws.lineLength < sizeof(ws.line) - 1){
+        ws.line[ws.lineLength++] = c;
+      }
+      continue;
+    }
+    ws.line[ws.lineLength] = 0;
+    if(strncasecmp(ws.line, "Sec-WebSocket-Key:", 18) == 0){
+      sscanf(ws.line + 18, " %63s", ws.key);
+    }
+    bool end = ws.lineLength == 0;
+    ws.lineLength = 0;
+    if(!end){
+      continue;
+    }
+    if(ws.key[0] == 0){
+      ws.client.print("HTTP/1.1 400 Bad Request\r\n\r\n");
+      ws.client.stop();
+      ws.state = WS_FREE;
+      return;
+    }
+    // Accept = base64(sha1(key + GUID))
+    unsigned char digest[20];
+    unsigned char accept[32];
+    size_t acceptLength = 0;
+    strncat(ws.key, WS_GUID, sizeof(ws.key) - strlen(ws.key) - 1);
+    mbedtls_sha1((const unsigned char *)ws.key, strlen(ws.key), digest);
+    mbedtls_base64_encode(accept, sizeof(accept) - 1, &acceptLength, digest, sizeof(digest));
+    accept[acceptLength] = 0;
+    ws.client.printf("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                     "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    ws.client.setNoDelay(true);
+    ws.state = WS_OPEN;
+    ws.cursor = logHead > LOG_RING_SIZE ? logHead - LOG_RING_SIZE : 0;
+    ws.frameStart = 0;
+    ws.frameEnd = 0;
+    ws.overruns = 0;
+    logLine("[WS] Client %d connected", slot);
+    return;
+  }
+}
+/********************************************
+ * name: wsPump()
+ * parameters: &ws
+ * description: Moves log ring data to one
+ * client with non-blocking sends. A slow
+ * client keeps its partial frame and, if it
+ * falls a whole ring behind, loses the
+ * oldest data; producers never wait on it.
+ ********************************************/
+void wsPump(WsClient &ws){
+  if(!ws.client.connected()){
+    ws.client.stop();
+    ws.state = WS_FREE;
+    return;
+  }
+  // Nothing is expected from clients, discard it
+  while(ws.client.available() > 0){
+    ws.client.read();
+  }
+  if(ws.frameStart == ws.frameEnd){
+    bool overrun;
+    size_t length = logRingRead(&ws.cursor, (char *)ws.frame + 4, WS_FRAME_SIZE, &overrun);
+    if(overrun){
+      ws.overruns++;
+    }
+    if(length == 0){
+      return;
+    }
+    // Unmasked text frame, header right in front of the payload
+    if(length < 126){
+      ws.frameStart = 2;
+      ws.frame[3] = length;
+    }
+    else{
+      ws.frameStart = 0;
+      ws.frame[1] = 126;
+      ws.frame[2] = length >> 8;
+      ws.frame[3] = length & 0xFF;
+    }
+    ws.frame[ws.frameStart] = 0x81;
+    ws.frameEnd = length + 4;
+  }
+  int sent = send(ws.client.fd(), ws.frame + ws.frameStart, ws.frameEnd - ws.frameStart, MSG_DONTWAIT);
+  if(sent > 0){
+    ws.frameStart += sent;
+  }
+  else if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK){
+    ws.client.stop();
+    ws.state = WS_FREE;
+  }
+}
+/********************************************
+ * name: wsMetrics()
+ * parameters: none
+ * description: Puts a metric line in the log
+ * ring with only the values that changed.
+ ********************************************/
+void wsMetrics(){
+  static uint32_t lastHeap = 0;
+  static int lastRssi = 0;
+  static unsigned long lastUplinkBytes = 0;
+  char line[LOG_LINE_LENGTH];
+  int length = snprintf(line, sizeof(line), "[METRIC]");
+  uint32_t heap = ESP.getFreeHeap();
+  int rssi = WiFi.RSSI();
+  // Ignore heap jitter below 1 KB
+  if(heap / 1024 != lastHeap / 1024){
+    length += snprintf(line + length, sizeof(line) - length, " heap=%u", (unsigned)heap);
+    lastHeap = heap;
+  }
+  if(rssi != lastRssi){
+    length += snprintf(line + length, sizeof(line) - length, " rssi=%d", rssi);
+    lastRssi = rssi;
+  }
+  if(uplinkBytes != lastUplinkBytes){
+    length += snprintf(line + length, sizeof(line) - length, " uplinkBytes=%lu", uplinkBytes);
+    lastUplinkBytes = uplinkBytes;
+  }
+  if(length > 8){
+    line[length++] = '\n';
+    logRingWrite(line, length);
+  }
+}
+// Syslog functions
+/********************************************
+ * name: syslogFlush()
+ * parameters: none
+ * description: Ships log ring records not
+ * sent yet as RFC 5424 messages, one per
+ * datagram (RFC 5426). sequenceId is the
+ * record's line number in the ring, so a
+ * wrap while offline shows up as a gap of
+ * exactly the records that were lost.
+ ********************************************/
+void syslogFlush(){
+  static char hostname[16] = {0};
+  static unsigned long records = 0;
+  static unsigned long cpuMicros = 0;
+  static unsigned long lastReport = 0;
+  char chunk[SYSLOG_DATAGRAM_SIZE / 2];
+  char datagram[SYSLOG_DATAGRAM_SIZE];
+  if(hostname[0] == 0){
+    snprintf(hostname, sizeof(hostname), "esp32-%06x", (unsigned)(ESP.getEfuseMac() & 0xFFFFFF));
+  }
+  for(;;){
+    unsigned long start = micros();
+    bool overrun;
+    size_t length = logRingRead(&syslogCursor, chunk, sizeof(chunk), &overrun);
+    if(length == 0){
+      break;
+    }
+    if(overrun){
+      // The ring wrapped while we were offline and the cursor now sits
+      // mid-line: resync past the fragment and skip the lost records
+      char *newline = (char *)memchr(chunk, '\n', length);
+      size_t fragment = newline ? newline - chunk + 1 : length;
+      syslogCursor -= length - fragment;
+      syslogSequence = logRingLineAt(syslogCursor);
+      continue;
+    }
+    size_t lineStart = 0;
+    int lines = 0;
+    for(size_t i=0;i<length;i++){
+      if(chunk[i] != '\n'){
+        continue;
+      }
+      int written = snprintf(datagram, sizeof(datagram),
+                             "<%d>1 - %s firmware - - [meta sequenceId=\"%u\"] %.*s", SYSLOG_PRI, hostname,
+                             (unsigned)++syslogSequence, (int)(i - lineStart), chunk + lineStart);
+      syslogUdp.beginPacket(SYSLOG_HOST, SYSLOG_PORT);
+      syslogUdp.write((const uint8_t *)datagram, constrain(written, 0, (int)sizeof(datagram) - 1));
+      syslogUdp.endPacket();
+      lineStart = i + 1;
+      lines++;
+    }
+    if(lines == 0 && length == sizeof(chunk)){
+      // Line longer than a chunk, skip it
+      lineStart = length;
+      syslogSequence++;
+    }
+    // Unsent bytes (partial lines) are read again next time
+    syslogCursor -= length - lineStart;
+    if(lines == 0){
+      break;
+    }
+    records += lines;
+    cpuMicros += micros() - start;
+  }
+  if(records > 0 && millis() - lastReport > 60000){
+    // Report via UART only, it would otherwise feed itself
+    char report[64];
+    int length = snprintf(report, sizeof(report), "[SYSLOG] %lu records, %lu us per record\n", records, cpuMicros / records);
+    consoleWrite(CHANNEL_LOG, (const uint8_t *)report, length);
+    lastReport = millis();
+  }
+}
+// Factory provisioning functions
+/********************************************
+ * name: provisionReply()
+ * parameters: type, payload, length
+ * description: Sends one frame on the
+ * provisioning UART: SOF, type, length (LE),
+ * payload, CRC-32 of type..payload.
+ ********************************************/
+void provisionReply(uint8_t type, const uint8_t *payload, uint16_t length){
+  uint8_t frame[PROVISION_MAX_FRAME + 8];
+  frame[0] = PROVISION_SOF;
+  frame[1] = type;
+  frame[2] = length & 0xFF;
+  frame[3] = length >> 8;
+  memcpy(frame + 4, payload, length);
+  uint32_t crc = crc32(frame + 1, length + 3);
+  memcpy(frame + 4 + length, &crc, 4);
+  Serial1.write(frame, length + 8);
+}
+/********************************************
+ * name: provisionHandle()
+ * parameters: type, payload, length
+ * description: Executes one request. SET
+ * commits both settings atomically; every
+ * reply carries status and the digest of
+ * the staged settings.
+ ********************************************/
+void provisionHandle(uint8_t type, uint8_t *payload, uint16_t length){
+  uint8_t reply[5] = {0};
+  if(type == PROVISION_SET){
+    const char *network = (const char *)payload;
+    size_t networkLength = strnlen(network, length);
+    const char *password = network + networkLength + 1;
+    // The password must be terminated inside the payload
+    if(length == 0 || payload[length - 1] != 0 ||
+       networkLength >= SETTINGS_LENGTH || networkLength + 1 >= length ||
+       strnlen(password, length - networkLength - 1) >= SETTINGS_LENGTH){
+      reply[0] = 2;  // Bad payload
+    }
+    else{
+      unsigned long start = micros();
+      if(saveWiFiSettings(network, password)){
+        logLine("[PROV] Settings committed in %lu us", micros() - start);
+      }
+      else{
+        reply[0] = 4;  // Commit failed
+      }
+    }
+  }
+  else if(type != PROVISION_DIGEST){
+    reply[0] = 3;  // Unknown request
+  }
+  uint32_t digest = settingsDigest();
+  memcpy(reply + 1, &digest, 4);
+  provisionReply(type | PROVISION_REPLY, reply, sizeof(reply));
+}
+// Shadow functions
+/********************************************
+ * name: jsonString()
+ * parameters: *text, out, size, *isNull
+ * description: Reads one JSON string or bare
+ * token (number, true, null) and advances
+ * text past it. Escapes are decoded, \uXXXX
+ * to UTF-8. Fails on a bad escape or a value
+ * that does not fit, rather than cutting it.
+ ********************************************/
+bool jsonString(const char **text, char *out, size_t size, bool *isNull){
+  const char *p = *text;
+  size_t length = 0;
+  *isNull = false;
+  while(*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'){
+    p++;
+  }
+  if(*p == '"'){
+    for(p++;*p && *p != '"';p++){
+      char decoded[3];
+      size_t count = 1;
+      decoded[0] = *p;
+      if(*p == '\\'){
+        switch(*++p){
+          case '"': case '\\': case '/': decoded[0] = *p; break;
+          case 'b': decoded[0] = '\b'; break;
+          case 'f': decoded[0] = '\f'; break;
+          case 'n': decoded[0] = '\n'; break;
+          case 'r': decoded[0] = '\r'; break;
+          case 't': decoded[0] = '\t'; break;
+          case 'u':{
+            unsigned code;
+            if(!isxdigit(p[1]) || !isxdigit(p[2]) || !isxdigit(p[3]) || !isxdigit(p[4]) ||
+               sscanf(p + 1, "%4x", &code) != 1 || code == 0 || (code >= 0xD800 && code < 0xE000)){
+              // Surrogate pairs don't fit a setting anyway
+              return false;
+            }
+            p += 4;
+            if(code < 0x80){
+              decoded[0] = code;
+            }
+            else if(code < 0x800){
+              decoded[0] = 0xC0 | code >> 6;
+              decoded[1] = 0x80 | (code & 0x3F);
+              count = 2;
+            }
+            else{
+              decoded[0] = 0xE0 | code >> 12;
+              decoded[1] = 0x80 | (code >> 6 & 0x3F);
+              decoded[2] = 0x80 | (code & 0x3F);
+              count = 3;
+            }
+            break;
+          }
+          default:
+            return false;
+        }
+      }
+      if(length + count >= size){
+        return false;
+      }
+      memcpy(out + length, decoded, count);
+      length += count;
+    }
+    if(*p++ != '"'){
+      return false;
+    }
+  }
+  else{
+    while(*p && strchr(",}] \n\r\t", *p) == NULL){
+      if(length + 1 >= size){
+        return false;
+      }
+      out[length++] = *p++;
+    }
+    *isNull = length == 4 && strncmp(out, "null", 4) == 0;
+  }
+  out[length] = 0;
+  *text = p;
+  return length > 0 || p[-1] == '"';
+}
+/********************************************
+ * name: shadowApply()
+ * parameters: document
+ * description: Applies a flat JSON merge
+ * patch of desired settings through the
+ * settings engine with a single commit. A
+ * null member leaves the setting as it is,
+ * and so do the WiFi credentials, which only
+ * BLE and the UARTs may change. Returns the
+ * number of settings changed.
+ ********************************************/
+int shadowApply(const char *document){
+  const char *p = strchr(document, '{');
+  int changed = 0;
+  if(p == NULL){
+    return 0;
+  }
+  p++;
+  for(;;){
+    char key[24];
+    char value[SETTINGS_LENGTH];
+    bool isNull;
+    while(*p == ' ' || *p == ',' || *p == '\n' || *p == '\r' || *p == '\t'){
+      p++;
+    }
+    if(*p == '}' || *p == 0 || !jsonString(&p, key, sizeof(key), &isNull)){
+      break;
+    }
+    p = strchr(p, ':');
+    if(p == NULL || !jsonString(&++p, value, sizeof(value), &isNull)){
+      logLine("[SHADOW] Bad or oversized value for %s, rest ignored", key);
+      break;
+    }
+    Setting *setting = settingFind(key);
+    if(setting == NULL || isNull){
+      continue;
+    }
+    if(!setting->desired){
+      logLine("[SHADOW] Ignored %s, not writable here", key);
+      continue;
+    }
+    char current[SETTINGS_LENGTH];
+    settingRead(*setting, current, sizeof(current));
+    if(strcmp(current, value) != 0 && settingWrite(key, value)){
+      changed++;
+    }
+  }
+  if(changed > 0){
+    settingsCommit();
+  }
+  return changed;
+}
+/********************************************
+ * name: shadowReportDelta()
+ * parameters: out, size
+ * description: Builds a JSON merge patch of
+ * reported settings that changed since the
+ * last successful report.
+ ********************************************/
+size_t shadowReportDelta(char *out, size_t size){
+  size_t length = snprintf(out, size, "{");
+  for(int i=0;i<SETTINGS_COUNT;i++){
+    Setting &setting = settings[i];
+    char value[SETTINGS_LENGTH];
+    settingRead(setting, value, sizeof(value));
+    if(!setting.reported || crc32((uint8_t *)value, strlen(value)) == shadowReported[i]){
+      continue;
+    }
+    length += snprintf(out + length, size - length, "%s\"%s\":\"", length > 1 ? "," : "", setting.key);
+    for(const char *c=value;*c && length < size - 4;c++){
+      if(*c == '"' || *c == '\\'){
+        out[length++] = '\\';
+      }
+      out[length++] = *c;
+    }
+    length += snprintf(out + length, size - length, "\"");
+  }
+  if(length == 1){
+    return 0;
+  }
+  length += snprintf(out + length, size - length, "}");
+  return min(length, size - 1);
+}
+/********************************************
+ * name: shadowSync()
+ * parameters: none
+ * description: Fetches the desired delta
+ * (ETag, so an unchanged document costs a
+ * 304) and applies it, then PATCHes only
+ * the reported values that changed.
+ ********************************************/
+void shadowSync(){
+  static String etag;
+  static char document[SHADOW_DOC_SIZE];
+  const char *headers[] = {"ETag"};
+  unsigned long bytes = 0;
+  HTTPClient http;
+  http.begin(SHADOW_URL "/desired");
+  http.collectHeaders(headers, 1);
+  if(etag.length() > 0){
+    http.addHeader("If-None-Match", etag);
+  }
+  int code = http.GET();
+  if(code == 200){
+    String body = http.getString();
+    bytes += body.length();
+    etag = http.header("ETag");
+    unsigned long start = micros();
+    int changed = shadowApply(body.c_str());
+    logLine("[SHADOW] Applied %d settings in %lu us", changed, micros() - start);
+  }
+  http.end();
+  size_t length = shadowReportDelta(document, sizeof(document));
+  if(length > 0){
+    http.begin(SHADOW_URL "/reported");
+    http.addHeader("Content-Type", "application/merge-patch+json");
+    if(http.PATCH((uint8_t *)document, length) / 100 == 2){
+      for(int i=0;i<SETTINGS_COUNT;i++){
+        char value[SETTINGS_LENGTH];
+        settingRead(settings[i], value, sizeof(value));
+        shadowReported[i] = crc32((uint8_t *)value, strlen(value));
+      }
+      bytes += length;
+    }
+    http.end();
+  }
+  if(bytes > 0){
+    logLine("[SHADOW] Synced, %lu payload bytes", bytes);
+  }
+}
+// Web asset functions
+/********************************************
+ * name: assetsMap()
+ * parameters: none
+ * description: Maps the assets partition
+ * into the address space. Files are sent
+ * from there, never copied to RAM, so every
+ * index entry must lie inside the partition.
+ ********************************************/
+bool assetsMap(){
+  const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, ASSETS_PARTITION);
+  spi_flash_mmap_handle_t handle;
+  const void *mapped;
+  if(partition == NULL || esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &mapped, &handle) != ESP_OK){
+    logLine("[WEB] No assets partition");
+    return false;
+  }
+  uint32_t header[2];
+  memcpy(header, mapped, sizeof(header));
+  if(header[0] != ASSETS_MAGIC || 8 + (uint64_t)header[1] * sizeof(AssetEntry) > partition->size){
+    logLine("[WEB] Assets partition is empty");
+    spi_flash_munmap(handle);
+    return false;
+  }
+  const AssetEntry *index = (const AssetEntry *)((const uint8_t *)mapped + 8);
+  for(uint32_t i=0;i<header[1];i++){
+    if((uint64_t)index[i].offset + index[i].length > partition->size){
+      logLine("[WEB] Asset %u lies outside the partition", (unsigned)i);
+      spi_flash_munmap(handle);
+      return false;
+    }
+  }
+  assets = (const uint8_t *)mapped;
+  assetCount = header[1];
+  logLine("[WEB] %u assets mapped", (unsigned)assetCount);
+  return true;
+}
+/********************************************
+ * name: contentType()
+ * parameters: path
+ * description: MIME type from the extension.
+ ********************************************/
+const char *contentType(const char *path){
+  const char *extension = strrchr(path, '.');
+  if(extension == NULL){
+    return "application/octet-stream";
+  }
+  if(strcmp(extension, ".html") == 0){
+    return "text/html";
+  }
+  if(strcmp(extension, ".css") == 0){
+    return "text/css";
+  }
+  if(strcmp(extension, ".js") == 0){
+    return "application/javascript";
+  }
+  if(strcmp(extension, ".json") == 0){
+    return "application/json";
+  }
+  if(strcmp(extension, ".svg") == 0){
+    return "image/svg+xml";
+  }
+  if(strcmp(extension, ".png") == 0){
+    return "image/png";
+  }
+  if(strcmp(extension, ".ico") == 0){
+    return "image/x-icon";
+  }
+  return "application/octet-stream";
+}
+/********************************************
+ * name: acceptsGzip()
+ * parameters: none
+ * description: Whether the request's
+ * Accept-Encoding allows gzip. No header
+ * means anything goes; q=0 refuses it.
+ ********************************************/
+bool acceptsGzip(){
+  if(!webServer.hasHeader("Accept-Encoding")){
+    return true;
+  }
+  String header = webServer.header("Accept-Encoding");
+  const char *coding = strstr(header.c_str(), "gzip");
+  if(coding == NULL){
+    coding = strstr(header.c_str(), "*");
+  }
+  if(coding == NULL){
+    return false;
+  }
+  const char *quality = strstr(coding, ";q=");
+  const char *next = strchr(coding, ',');
+  return quality == NULL || (next != NULL && quality > next) || strtod(quality + 3, NULL) > 0;
+}
+/********************************************
+ * name: serveAsset()
+ * parameters: none
+ * description: Sends the requested asset
+ * gzip-encoded straight from the mapped
+ * flash, or 304 when the client's ETag
+ * still matches, or 406 when the client
+ * won't take gzip. Only headers use RAM.
+ ********************************************/
+void serveAsset(){
+  String uri = webServer.uri();
+  const char *path = strcmp(uri.c_str(), "/") == 0 ? "/index.html" : uri.c_str();
+  const AssetEntry *index = (const AssetEntry *)(assets + 8);
+  for(uint32_t i=0;i<assetCount;i++){
+    if(strncmp(index[i].path, path, sizeof(index[i].path)) != 0){
+      continue;
+    }
+    char etag[12];
+    snprintf(etag, sizeof(etag), "\"%08x\"", (unsigned)index[i].etag);
+    webServer.sendHeader("ETag", etag);
+    webServer.sendHeader("Cache-Control", "no-cache");
+    webServer.sendHeader("Vary", "Accept-Encoding");
+    if(strcmp(webServer.header("If-None-Match").c_str(), etag) == 0){
+      webServer.send(304);
+      return;
+    }
+    if(!acceptsGzip()){
+      // Assets are only stored compressed
+      webServer.send(406, "text/plain", "gzip required");
+      return;
+    }
+    webServer.sendHeader("Content-Encoding", "gzip");
+    webServer.setContentLength(index[i].length);
+    webServer.send(200, contentType(path), "");
+    webServer.client().write(assets + index[i].offset, index[i].length);
+    return;
+  }
+  webServer.send(404, "text/plain", "Not found");
+}
+// Storage functions
+/********************************************
+ * class name: Journal
+ * functions: begin(), append(), sync(),
+ * compactStep()
+ * description: Rotating segment files in one
+ * directory, named by sequence number. A
+ * segment is closed when it is full or
+ * FS_SEGMENT_AGE_MS old; the oldest go when
+ * there are too many or the partition fills
+ * up. Closed log segments are compacted into
+ * LZSS blocks ([u16 stored][u16 raw][data],
+ * stored == raw means uncompressed) in
+ * slices, via a .tmp file that is renamed
+ * into place, so a reset never loses data.
+ ********************************************/
+class Journal {
+  public:
+    unsigned long appended = 0;
+    unsigned long appendUs = 0;
+    unsigned long rotations = 0;
+    unsigned long compactedIn = 0;
+    unsigned long compactedOut = 0;
+    Journal(const char *dir, int maxSegments, bool compact): dir(dir), maxSegments(maxSegments), compact(compact) {}
+    bool begin(){
+      LittleFS.mkdir(dir);
+      uint32_t oldest, newest, oldestLog;
+      int count;
+      char name[32];
+      if(scan(&oldest, &newest, &count, &oldestLog)){
+        // Compaction cut short: the .log is still complete
+        path(name, tmpSequence, "tmp");
+        LittleFS.remove(name);
+      }
+      path(name, oldestLog, "lz");
+      if(oldestLog != UINT32_MAX && LittleFS.exists(name)){
+        // Renamed but the .log not yet removed
+        path(name, oldestLog, "log");
+        LittleFS.remove(name);
+      }
+      sequence = count > 0 ? newest : 0;
+      rotate();
+      return segment;
+    }
+    void append(const uint8_t *data, size_t length){
+      if(!segment){
+        return;
+      }
+      if(segment.size() + length > FS_SEGMENT_SIZE ||
+         (segment.size() > 0 && millis() - openedAt > FS_SEGMENT_AGE_MS)){
+        rotate();
+      }
+      unsigned long start = micros();
+      segment.write(data, length);
+      appendUs += micros() - start;
+      appended += length;
+    }
+    void sync(){
+      if(segment){
+        segment.flush();
+      }
+    }
+    /********************************************
+     * name: compactStep()
+     * parameters: deadline
+     * description: Compacts the oldest closed
+     * log segment until millis() reaches
+     * deadline. Returns false when there is
+     * nothing left to do.
+     ********************************************/
+    bool compactStep(unsigned long deadline){
+      uint8_t raw[FS_COMPACT_BLOCK];
+      uint8_t block[FS_COMPACT_BLOCK + 4];
+      char name[32];
+      if(!compact || compactIdle){
+        return false;
+      }
+      if(!compactIn){
+        uint32_t oldest, newest, oldestLog;
+        int count;
+        scan(&oldest, &newest, &count, &oldestLog);
+        if(oldestLog == UINT32_MAX){
+          compactIdle = true;
+          return false;
+        }
+        compactSequence = oldestLog;
+        path(name, compactSequence, "log");
+        compactIn = LittleFS.open(name, "r");
+        path(name, compactSequence, "tmp");
+        compactOut = LittleFS.open(name, "w");
+        if(!compactIn || !compactOut){
+          compactIn.close();
+          compactOut.close();
+          compactIdle = true;
+          return false;
+        }
+      }
+      while((long)(millis() - deadline) < 0){
+        size_t length = compactIn.read(raw, sizeof(raw));
+        if(length == 0){
+          compactIn.close();
+          compactOut.close();
+          char lz[32];
+          path(name, compactSequence, "tmp");
+          path(lz, compactSequence, "lz");
+          LittleFS.rename(name, lz);
+          path(name, compactSequence, "log");
+          LittleFS.remove(name);
+          return true;
+        }
+        size_t stored = lzCompress(raw, length, block + 4, length - 1);
+        if(stored == 0){
+          memcpy(block + 4, raw, length);
+          stored = length;
+        }
+        block[0] = stored & 0xFF;
+        block[1] = stored >> 8;
+        block[2] = length & 0xFF;
+        block[3] = length >> 8;
+        compactOut.write(block, stored + 4);
+        compactedIn += length;
+        compactedOut += stored + 4;
+      }
+      return true;
+    }
+    int segments(){
+      uint32_t oldest, newest, oldestLog;
+      int count;
+      scan(&oldest, &newest, &count, &oldestLog);
+      return count;
+    }
+  private:
+    const char *dir;
+    int maxSegments;
+    bool compact;
+    File segment;
+    uint32_t sequence = 0;
+    unsigned long openedAt = 0;
+    File compactIn;
+    File compactOut;
+    uint32_t compactSequence = 0;
+    uint32_t tmpSequence = 0;
+    bool compactIdle = false;
+    void path(char *out, uint32_t number, const char *extension){
+      snprintf(out, 32, "%s/%08lu.%s", dir, (unsigned long)number, extension);
+    }
+    /********************************************
+     * name: scan()
+     * parameters: *oldest, *newest, *count,
+     * *oldestLog
+     * description: Walks the directory. Returns
+     * true when a .tmp was found (its number in
+     * tmpSequence). oldestLog is the oldest
+     * closed segment not yet compacted. Names
+     * other than <number>.<log|lz|dat|tmp> are
+     * not ours and are left alone.
+     ********************************************/
+    bool scan(uint32_t *oldest, uint32_t *newest, int *count, uint32_t *oldestLog){
+      bool tmpFound = false;
+      *oldest = UINT32_MAX;
+      *newest = 0;
+      *count = 0;
+      *oldestLog = UINT32_MAX;
+      File root = LittleFS.open(dir);
+      for(File file = root.openNextFile(); file; file = root.openNextFile()){
+        const char *name = strrchr(file.name(), '/');
+        name = name != NULL ? name + 1 : file.name();
+        char *extension;
+        uint32_t number = strtoul(name, &extension, 10);
+        if(!isdigit(name[0]) || (strcmp(extension, ".log") != 0 && strcmp(extension, ".lz") != 0 &&
+           strcmp(extension, ".dat") != 0 && strcmp(extension, ".tmp") != 0)){
+          continue;
+        }
+        if(strcmp(extension, ".tmp") == 0){
+          tmpSequence = number;
+          tmpFound = true;
+          continue;
+        }
+        (*count)++;
+        *oldest = min(*oldest, number);
+        *newest = max(*newest, number);
+        if(strcmp(extension, ".log") == 0 && !(segment && number == sequence) &&
+           !(compactIn && number == compactSequence)){
+          *oldestLog = min(*oldestLog, number);
+        }
+      }
+      return tmpFound;
+    }
+    void rotate(){
+      char name[32];
+      if(segment){
+        segment.close();
+        rotations++;
+      }
+      path(name, ++sequence, compact ? "log" : "dat");
+      segment = LittleFS.open(name, "w");
+      openedAt = millis();
+      compactIdle = false;
+      prune();
+    }
+    void prune(){
+      for(;;){
+        uint32_t oldest, newest, oldestLog;
+        int count;
+        scan(&oldest, &newest, &count, &oldestLog);
+        bool full = LittleFS.usedBytes() > LittleFS.totalBytes() / 100 * FS_FULL_PERCENT;
+        if(count <= 1 || (count <= maxSegments && !full) || oldest == sequence ||
+           (compactIn && oldest == compactSequence)){
+          return;
+        }
+        char name[32];
+        bool removed = false;
+        for(const char *extension : {"log", "lz", "dat"}){
+          path(name, oldest, extension);
+          removed |= LittleFS.remove(name);
+        }
+        if(!removed){
+          // Nothing went, the next pass would see the same directory
+          logLine("[FS] Cannot prune segment %lu in %s", (unsigned long)oldest, dir);
+          return;
+        }
+      }
+    }
+};
+Journal logJournal(FS_LOG_DIR, FS_LOG_SEGMENTS, true);
+Journal dataJournal(FS_DATA_DIR, FS_DATA_SEGMENTS, false);
+// Overload functions
+/********************************************
+ * name: overloadRegister()
+ * parameters: name, level, shed
+ * description: Registers a task's degradable
+ * work. shed(true) is called once the load
+ * reaches level, shed(false) when it is
+ * back below it.
+ ********************************************/
+void overloadRegister(const char *name, uint8_t level, void (*shed)(bool on)){
+  portENTER_CRITICAL(&overloadMux);
+  if(degradableCount < OVERLOAD_MAX_WORK){
+    degradables[degradableCount].name = name;
+    degradables[degradableCount].level = level;
+    degradables[degradableCount].shed = shed;
+    degradables[degradableCount].shedding = false;
+    degradableCount++;
+  }
+  portEXIT_CRITICAL(&overloadMux);
+}
+/********************************************
+ * name: overloadMeasure()
+ * parameters: none
+ * description: Load level from the fullest
+ * drop-newest queue, drops from drop-oldest
+ * queues while the uplink is up, free heap
+ * against its steady state and, when the
+ * core build keeps run time stats, the busy
+ * time of each core. Drop-oldest queues
+ * simply fill while WiFi is down, which is
+ * no reason to shed work.
+ ********************************************/
+uint8_t overloadMeasure(){
+  static unsigned long lastDropped[CLASS_COUNT];
+  uint8_t level = LOAD_NORMAL;
+  int queue = 0;
+  bool connected = WiFi.status() == WL_CONNECTED;
+  for(int i=0;i<CLASS_COUNT;i++){
+    if(classConfig[i].dropPolicy == DROP_NEWEST){
+      queue = max(queue, (int)(uxQueueMessagesWaiting(classQueues[i]) * 100 / classConfig[i].queueLimit));
+    }
+    else if(connected && classDropped[i] != lastDropped[i]){
+      // Losing data even though the uplink is up: it can't keep up
+      level = LOAD_ELEVATED;
+    }
+    lastDropped[i] = classDropped[i];
+  }
+  if(gatewayQueue != NULL){
+    queue = max(queue, (int)(uxQueueMessagesWaiting(gatewayQueue) * 100 / GATEWAY_QUEUE_LEN));
+  }
+  loadQueue = queue;
+  uint32_t heap = ESP.getFreeHeap();
+  if(overloadHeapBaseline == 0 && connected){
+    overloadHeapBaseline = heap;
+  }
+  for(int i=0;i<3;i++){
+    uint32_t heapLimit = max((uint32_t)LOW_HEAP_ALARM, overloadHeapBaseline * overloadHeapPercent[i] / 100);
+    if(queue >= overloadQueuePercent[i] || heap < heapLimit){
+      level = i + 1;
+    }
+  }
+#if configGENERATE_RUN_TIME_STATS && configUSE_TRACE_FACILITY
+  static uint32_t lastIdle[portNUM_PROCESSORS];
+  static uint32_t lastTotal = 0;
+  uint32_t total = portGET_RUN_TIME_COUNTER_VALUE();
+  for(int core=0;core<portNUM_PROCESSORS;core++){
+    TaskStatus_t status;
+    vTaskGetInfo(xTaskGetIdleTaskHandleForCPU(core), &status, pdFALSE, eRunning);
+    if(lastTotal != 0 && total != lastTotal){
+      uint32_t idle = status.ulRunTimeCounter - lastIdle[core];
+      loadCpu[core] = 100 - (int)min((uint64_t)100, (uint64_t)idle * 100 / (total - lastTotal));
+      for(int i=0;i<3;i++){
+        if(loadCpu[core] >= overloadCpuPercent[i]){
+          level = max(level, (uint8_t)(i + 1));
+        }
+      }
+    }
+    lastIdle[core] = status.ulRunTimeCounter;
+  }
+  lastTotal = total;
+#endif
+  return level;
+}
+// Transmit power functions
+/********************************************
+ * name: txPowerSet()
+ * parameters: level
+ * description: Applies one of txPowerLevels.
+ ********************************************/
+void txPowerSet(int level){
+  xSemaphoreTakeRecursive(txPowerMutex, portMAX_DELAY);
+  if(level != txPowerLevel){
+    WiFi.setTxPower(txPowerLevels[level]);
+    logLine("[WIFI] TX power %d.%02d dBm, margin %d dB", txPowerLevels[level] / 4, txPowerLevels[level] % 4 * 25, txPowerMargin);
+    txPowerLevel = level;
+    txPowerChanges++;
+  }
+  xSemaphoreGiveRecursive(txPowerMutex);
+}
+/********************************************
+ * name: txPowerReset()
+ * parameters: linkLost
+ * description: Connect attempts go out at
+ * full power. A link that was up and got
+ * lost also widens the margin for the next
+ * connection, once, not per retry.
+ ********************************************/
+void txPowerReset(bool linkLost){
+  xSemaphoreTakeRecursive(txPowerMutex, portMAX_DELAY);
+  if(linkLost){
+    txPowerMargin = min(txPowerMargin + 3, TXPOWER_MAX_MARGIN);
+  }
+  WiFi.setTxPower(txPowerLevels[0]);
+  txPowerLevel = 0;
+  xSemaphoreGiveRecursive(txPowerMutex);
+}
+/********************************************
+ * name: txPowerAdapt()
+ * parameters: none
+ * description: Closed loop, run once per
+ * WiFi check. The AP's RSSI gives the path
+ * loss and so the lowest power that still
+ * reaches the AP; the margin on top grows
+ * with uplink failures or slow sends (per
+ * request, so payload size doesn't count)
+ * and shrinks while the link is healthy.
+ * Power goes up at once but down one step
+ * per check.
+ ********************************************/
+void txPowerAdapt(){
+  static unsigned long lastFailures = 0;
+  static unsigned long lastSends = 0;
+  static unsigned long lastRadioMs = 0;
+  unsigned long sends = uplinkSends - lastSends;
+  bool struggling = uplinkFailures != lastFailures ||
+                    (sends > 0 && (radioOnMs - lastRadioMs) / sends > TXPOWER_SEND_MS);
+  lastFailures = uplinkFailures;
+  lastSends = uplinkSends;
+  lastRadioMs = radioOnMs;
+  xSemaphoreTakeRecursive(txPowerMutex, portMAX_DELAY);
+  txPowerMargin = struggling ? min(txPowerMargin + 3, TXPOWER_MAX_MARGIN) : max(txPowerMargin - 1, TXPOWER_MIN_MARGIN);
+  int level = 0;
+#if MESH_MODE
+  // Children out of AP range depend on our reach
+  if(meshHops > 0){
+    txPowerSet(0);
+    xSemaphoreGiveRecursive(txPowerMutex);
+    return;
+  }
+#endif
+  int needed = (TXPOWER_RSSI_TARGET + TXPOWER_AP_DBM - WiFi.RSSI() + txPowerMargin) * 4;
+  while(level + 1 < TXPOWER_LEVELS && txPowerLevels[level + 1] >= needed){
+    level++;
+  }
+  txPowerSet(level < txPowerLevel ? level : min(level, txPowerLevel + 1));
+  xSemaphoreGiveRecursive(txPowerMutex);
+}
+// Input functions
+/********************************************
+ * name: inputIsr()
+ * parameters: arg (pin | input << 8)
+ * description: Timestamps an edge and queues
+ * it for inputTask(). Runs from IRAM and
+ * touches nothing in flash, so it is safe
+ * during EEPROM commits.
+ ********************************************/
+void IRAM_ATTR inputIsr(void *arg){
+  uint32_t packed = (uint32_t)(uintptr_t)arg;
+  InputEdge edge;
+  edge.time = micros();
+  edge.input = packed >> 8;
+  edge.pressed = !gpio_ll_get_level(&GPIO, (gpio_num_t)(packed & 0xFF));
+  BaseType_t woken = pdFALSE;
+  if(xQueueSendFromISR(inputQueue, &edge, &woken) != pdTRUE){
+    inputOverruns++;
+  }
+  portYIELD_FROM_ISR(woken);
+}
+/********************************************
+ * name: inputProvision()
+ * parameters: none
+ * description: Opens a provisioning window:
+ * BLE gets the antenna and WiFi connects
+ * wait, as during a BLE session.
+ ********************************************/
+void inputProvision(){
+  logLine("[INPUT] Provisioning window open");
+  radioActivityBegin(ACT_PROVISIONING);
+  xTimerReset(provisionWindowTimer, 0);
+}
+void provisionWindowEnd(TimerHandle_t timer){
+  blePendingSet(BLE_PENDING_WINDOW);
+}
+/********************************************
+ * name: inputFactoryReset()
+ * parameters: none
+ * description: Clears every setting and
+ * restarts with the defaults.
+ ********************************************/
+void inputFactoryReset(){
+  logLine("[INPUT] Factory reset");
+  xSemaphoreTakeRecursive(eepromMutex, portMAX_DELAY);
+  for(int i=0;i<EEPROM_SIZE;i++){
+    EEPROM.write(i, 0);
+  }
+  settingsCommit();
+  ESP.restart();
+}
+const GestureAction gestureActions[] = {
+  {0, GESTURE_DOUBLE, inputProvision},
+  {0, GESTURE_LONG,   inputFactoryReset},
+};
+/********************************************
+ * name: inputGesture()
+ * parameters: input, gesture, since
+ * description: Publishes a detected gesture
+ * and runs its actions. since is the time
+ * of the edge that completed it.
+ ********************************************/
+void inputGesture(int input, uint8_t gesture, uint32_t since){
+  char event[32];
+  int length = snprintf(event, sizeof(event), "input:%s:%s", inputPins[input].name, gestureNames[gesture]);
+  traceEvent(TRACE_INPUT, input << 4 | gesture);
+  logLine("[INPUT] %s %s, %lu ms after the last edge", inputPins[input].name, gestureNames[gesture],
+          (unsigned long)(micros() - since) / 1000);
+  publishMessage(CLASS_STATE, (const uint8_t *)event, length);
+  for(const GestureAction &action : gestureActions){
+    if(action.input == input && action.gesture == gesture){
+      action.action();
+    }
+  }
+}
+// Console command functions
+/********************************************
+ * name: cmdStatus()
+ * parameters: args
+ * description: One-screen device summary.
+ ********************************************/
+void cmdStatus(const char *args){
+  consolePrintf("uptime %lu s, heap %u free, %u min, %u largest\r\n", millis() / 1000,
+                ESP.getFreeHeap(), ESP.getMinFreeHeap(), ESP.getMaxAllocHeap());
+  consolePrintf("wifi %s, ble %s, settings %08x\r\n",
+                WiFi.status() == WL_CONNECTED ? "connected" : "disconnected",
+                deviceConnected ? "connected" : "advertising", (unsigned)settingsDigest());
+}
+/********************************************
+ * name: cmdWifi()
+ * parameters: args
+ * description: Link details. "wifi reconnect"
+ * drops the link and keepWiFiAlive() brings
+ * it back up on its next check.
+ ********************************************/
+void cmdWifi(const char *args){
+  if(strcmp(args, "reconnect") == 0){
+    WiFi.disconnect();
+    consolePrintf("disconnected\r\n");
+    return;
+  }
+  consolePrintf("network %s, status %d\r\n", WIFI_NETWORK, WiFi.status());
+  if(WiFi.status() == WL_CONNECTED){
+    consolePrintf("ip %s, rssi %d dBm, channel %d, mesh hops %u\r\n", WiFi.localIP().toString().c_str(),
+                  WiFi.RSSI(), (int)WiFi.channel(), meshHops);
+    consolePrintf("tx power %d.%02d dBm, margin %d dB, %lu changes, %lu uplink failures\r\n",
+                  txPowerLevels[txPowerLevel] / 4, txPowerLevels[txPowerLevel] % 4 * 25, txPowerMargin,
+                  txPowerChanges, uplinkFailures);
+  }
+}
+/********************************************
+ * name: cmdBle()
+ * parameters: args
+ * description: GATT server and gateway state.
+ ********************************************/
+void cmdBle(const char *args){
+  consolePrintf("%s, profile %s, mtu %u\r\n", deviceConnected ? "connected" : "advertising",
+                bleProfile != NULL ? bleProfile->name : "none", BLEDevice::getMTU());
+  consolePrintf("gateway %lu adverts, %lu duplicates, %lu dropped\r\n",
+                gatewayAdverts, gatewayDuplicates, gatewayDropped);
+}
+/********************************************
+ * name: cmdSettings()
+ * parameters: args
+ * description: Lists the settings, or takes
+ * "key=value" and commits it to flash.
+ ********************************************/
+void cmdSettings(const char *args){
+  const char *split = strchr(args, '=');
+  if(split == NULL){
+    for(int i=0;i<SETTINGS_COUNT;i++){
+      char value[SETTINGS_LENGTH];
+      settingRead(settings[i], value, sizeof(value));
+      consolePrintf("%s=%s\r\n", settings[i].key, settings[i].reported ? value : "****");
+    }
+    return;
+  }
+  char key[SETTINGS_LENGTH] = {0};
+  strncpy(key, args, min((size_t)(split - args), sizeof(key) - 1));
+  if(!settingWrite(key, split + 1)){
+    consolePrintf("rejected\r\n");
+    return;
+  }
+  bool committed = settingsCommit();
+  if(!committed){
+    consolePrintf("commit failed\r\n");
+  }
+  logLine("[CLI] Changed setting %s", key);
+  notifyProvisionStatus("config", committed);
+}
+/********************************************
+ * name: cmdTasks()
+ * parameters: args
+ * description: Stack headroom of the tasks
+ * that keep a handle.
+ ********************************************/
+void cmdTasks(const char *args){
+  TaskHandle_t handles[] = {bleStatusHandle, keepWiFiAliveHandle, myTaskHandle, uplinkTaskHandle, consoleTaskHandle};
+  consolePrintf("%u tasks\r\n", (unsigned)uxTaskGetNumberOfTasks());
+  for(TaskHandle_t handle : handles){
+    if(handle != NULL){
+      consolePrintf("%-16s %5u bytes free stack\r\n", pcTaskGetName(handle),
+                    (unsigned)uxTaskGetStackHighWaterMark(handle));
+    }
+  }
+}
+/********************************************
+ * name: cmdMetrics()
+ * parameters: args
+ * description: Uplink and scheduler counters.
+ ********************************************/
+void cmdMetrics(const char *args){
+  consolePrintf("uplink %lu bytes, radio %lu ms, batch %d records\r\n", uplinkBytes, radioOnMs, batchRecords);
+  consolePrintf("%lu rejected, %lu dropped after %d attempts\r\n", uplinkRejected, uplinkAbandoned, UPLINK_MAX_ATTEMPTS);
+  consolePrintf("tls %lu handshakes, %lu ms avg\r\n", tlsHandshakes,
+                tlsHandshakes > 0 ? tlsHandshakeMs / tlsHandshakes : 0);
+  for(int i=0;i<CLASS_COUNT;i++){
+    consolePrintf("%-10s %2u queued, %lu dropped\r\n", classConfig[i].name,
+                  (unsigned)uxQueueMessagesWaiting(classQueues[i]), classDropped[i]);
+  }
+  consolePrintf("mesh %lu relayed, %lu bytes, %lu refused, %lu oversize\r\n", meshRelayed, meshRelayBytes, meshRefused, meshOversize);
+  consolePrintf("load %s, queue %d%%, cpu %d%%/%d%%\r\n", loadNames[loadLevel], loadQueue, loadCpu[0], loadCpu[1]);
+  consolePrintf("input %lu edges, %lu overruns, %lu us cpu\r\n", inputEdges, inputOverruns, inputBusyUs);
+}
+/********************************************
+ * name: cmdFrame()
+ * parameters: args
+ * description: "frame on" switches to COBS
+ * framed mode for host tools, "frame off"
+ * (sent on the CLI channel) back to text.
+ ********************************************/
+void cmdFrame(const char *args){
+  if(strcmp(args, "on") == 0){
+    consolePrintf("framed\r\n");
+    consoleFramed = true;
+  }
+  else if(strcmp(args, "off") == 0){
+    consoleFramed = false;
+    consolePrintf("text\r\n");
+  }
+  else{
+    consolePrintf("usage: frame on|off\r\n");
+  }
+}
+/********************************************
+ * name: cmdPower()
+ * parameters: args
+ * description: Time at each CPU level and
+ * the estimated saving over a fixed clock.
+ * Without esp_pm the levels are only what
+ * was requested, so there is no saving.
+ ********************************************/
+void cmdPower(const char *args){
+  unsigned long ms[2];
+  xSemaphoreTake(powerMutex, portMAX_DELAY);
+  memcpy(ms, levelMs, sizeof(ms));
+  ms[boostTotal > 0] += millis() - levelSince;
+  xSemaphoreGive(powerMutex);
+  consolePrintf("%d MHz %lu ms, %d MHz %lu ms, now %u MHz\r\n", PM_MIN_MHZ, ms[0], PM_MAX_MHZ, ms[1],
+                (unsigned)getCpuFrequencyMhz());
+  for(int i=0;i<BOOST_COUNT;i++){
+    consolePrintf("%-9s %lu boosts\r\n", boostNames[i], boostCount[i]);
+  }
+  if(powerLock == NULL){
+    consolePrintf("no esp_pm, levels requested only, clock fixed\r\n");
+    return;
+  }
+  float fixed = (float)(ms[0] + ms[1]) * PM_MAX_MA;
+  float scaled = (float)ms[0] * PM_MIN_MA + (float)ms[1] * PM_MAX_MA;
+  consolePrintf("~%d%% less CPU current than a fixed %d MHz\r\n",
+                fixed > 0 ? (int)(100 - scaled * 100 / fixed) : 0, PM_MAX_MHZ);
+}
+/********************************************
+ * name: cmdFs()
+ * parameters: args
+ * description: Partition usage and journal
+ * throughput and compaction counters.
+ ********************************************/
+void cmdFs(const char *args){
+  if(!fsMounted){
+    consolePrintf("not mounted\r\n");
+    return;
+  }
+  consolePrintf("%u of %u bytes used\r\n", (unsigned)LittleFS.usedBytes(), (unsigned)LittleFS.totalBytes());
+  Journal *journals[] = {&logJournal, &dataJournal};
+  const char *names[] = {"log", "data"};
+  for(int i=0;i<2;i++){
+    Journal &journal = *journals[i];
+    consolePrintf("%-4s %d segments, %lu bytes, %lu KB/s, %lu rotations\r\n", names[i], journal.segments(),
+                  journal.appended, journal.appendUs > 0 ? (unsigned long)((uint64_t)journal.appended * 1000 / journal.appendUs) : 0,
+                  journal.rotations);
+  }
+  consolePrintf("compacted %lu to %lu bytes\r\n", logJournal.compactedIn, logJournal.compactedOut);
+}
+void cmdHelp(const char *args);
+constexpr ConsoleCommand consoleCommands[] = {
+  {"help",     "this list",                          cmdHelp},
+  {"status",   "uptime, heap, links",                cmdStatus},
+  {"wifi",     "link details, wifi reconnect",       cmdWifi},
+  {"ble",      "GATT server and gateway",            cmdBle},
+  {"settings", "list, or settings key=value",        cmdSettings},
+  {"tasks",    "stack headroom",                     cmdTasks},
+  {"metrics",  "uplink and scheduler counters",      cmdMetrics},
+  {"power",    "time at each CPU level",             cmdPower},
+  {"fs",       "log and data partition",             cmdFs},
+  {"frame",    "frame on|off, COBS framed mode",     cmdFrame},
+};
+void cmdHelp(const char *args){
+  for(const ConsoleCommand &command : consoleCommands){
+    consolePrintf("%-9s %s\r\n", command.name, command.help);
+  }
+}
+/********************************************
+ * name: consoleExecute()
+ * parameters: line
+ * description: Runs one command line.
+ ********************************************/
+void consoleExecute(char *line){
+  char *args = strchr(line, ' ');
+  if(args != NULL){
+    *args++ = 0;
+    while(*args == ' '){
+      args++;
+    }
+  }
+  else{
+    args = line + strlen(line);
+  }
+  for(const ConsoleCommand &command : consoleCommands){
+    if(strcmp(command.name, line) == 0){
+      command.handler(args);
+      return;
+    }
+  }
+  consolePrintf("unknown command %s, try help\r\n", line);
+}
+/********************************************
+ * name: consoleRpc()
+ * parameters: payload, length
+ * description: Binary request on the RPC
+ * channel. Replies with type | RPC_REPLY,
+ * status (0 ok, 2 bad payload, 3 unknown
+ * request, 4 not readable, 5 commit failed)
+ * and any data.
+ ********************************************/
+void consoleRpc(const uint8_t *payload, size_t length){
+  uint8_t reply[2 + SETTINGS_LENGTH] = {0};
+  size_t replyLength = 2;
+  // Room for the terminator the host may leave off
+  char text[CONSOLE_FRAME_SIZE] = {0};
+  if(length == 0){
+    return;
+  }
+  memcpy(text, payload + 1, length - 1);
+  reply[0] = payload[0] | RPC_REPLY;
+  if(payload[0] == RPC_GET_SETTING){
+    Setting *setting = settingFind(text);
+    if(setting == NULL){
+      reply[1] = 2;
+    }
+    else if(!setting->reported){
+      reply[1] = 4;
+    }
+    else{
+      settingRead(*setting, (char *)reply + 2, SETTINGS_LENGTH);
+      replyLength += strlen((char *)reply + 2);
+    }
+  }
+  else if(payload[0] == RPC_SET_SETTING){
+    size_t keyLength = strlen(text);
+    if(keyLength + 1 >= length || !settingWrite(text, text + keyLength + 1)){
+      reply[1] = 2;
+    }
+    else{
+      bool committed = settingsCommit();
+      if(!committed){
+        reply[1] = 5;
+      }
+      logLine("[CLI] Changed setting %s", text);
+      notifyProvisionStatus("config", committed);
+    }
+  }
+  else if(payload[0] == RPC_DIGEST){
+    uint32_t digest = settingsDigest();
+    memcpy(reply + 2, &digest, 4);
+    replyLength += 4;
+  }
+  else{
+    reply[1] = 3;
+  }
+  consoleWrite(CHANNEL_RPC, reply, replyLength);
+}
+/********************************************
+ * name: consoleFrame()
+ * parameters: encoded, length
+ * description: Decodes one COBS frame and
+ * hands it to its channel. Malformed frames
+ * are dropped.
+ ********************************************/
+void consoleFrame(const uint8_t *encoded, size_t length){
+  uint8_t frame[CONSOLE_FRAME_SIZE + 1];
+  size_t frameLength = 0;
+  for(size_t i=0;i<length;){
+    uint8_t code = encoded[i++];
+    if(code == 0 || i + code - 1 > length || frameLength + code > CONSOLE_FRAME_SIZE){
+      return;
+    }
+    for(uint8_t j=1;j<code;j++){
+      frame[frameLength++] = encoded[i++];
+    }
+    if(code != 0xFF && i < length){
+      frame[frameLength++] = 0;
+    }
+  }
+  if(frameLength == 0){
+    return;
+  }
+  if(frame[0] == CHANNEL_CLI){
+    frame[frameLength] = 0;
+    consoleExecute((char *)frame + 1);
+  }
+  else if(frame[0] == CHANNEL_RPC){
+    consoleRpc(frame + 1, frameLength - 1);
+  }
+}
+// RTOS Tasks
+/********************************************
+ * name: blePendingRun()
+ * parameters: none
+ * description: Does the work the BLE idle
+ * and provisioning window timers handed
+ * over through blePendingSet().
+ ********************************************/
+void blePendingRun(){
+  portENTER_CRITICAL(&blePendingMux);
+  uint8_t pending = blePending;
+  blePending = 0;
+  portEXIT_CRITICAL(&blePendingMux);
+  if(pending & BLE_PENDING_IDLE){
+    setConnProfile(PROFILE_RELAXED);
+    powerBoostHold(BOOST_BLE_BULK, false);
+  }
+  // A connected session ends the window on disconnect instead
+  if((pending & BLE_PENDING_WINDOW) && !deviceConnected){
+    radioActivityEnd(ACT_PROVISIONING);
   }
-};
-// RTOS Tasks
+}
 /********************************************
  * name: bleStatus()
  * parameters: none
  * description: Outputs the status on the
- * BLE server.
+ * BLE server, and runs blePendingRun() when
+ * a timer notifies it.
  ********************************************/
 void bleStatus(void *parameter){
+  TickType_t lastWake = xTaskGetTickCount();
   while(1){
+    blePendingRun();
+    // Like taskDelayUntil(), but a notification is handled right away
+    TickType_t deadline = lastWake + BLE_STATUS_PERIOD_MS / portTICK_PERIOD_MS;
+    TickType_t now = xTaskGetTickCount();
+    if((int32_t)(deadline - now) > 0){
+      ulTaskNotifyTake(pdTRUE, deadline - now);
+      continue;
+    }
+    lastWake = (int32_t)(now - deadline) > (int32_t)(BLE_STATUS_PERIOD_MS / portTICK_PERIOD_MS) ? now : deadline;
     if(deviceConnected == true){
-      Serial.println("[BLE] Connected");
+      logDebug("[BLE] Connected");
     }
     else{
-      Serial.println("[BLE] Disconnected");
+      logDebug("[BLE] Disconnected");
     }
-    vTaskDelay(5000 / portTICK_PERIOD_MS);
   }
 }
 /********************************************
@@ -139,31 +3920,688 @@ void bleStatus(void *parameter){
  * it tries to make one.
  ********************************************/
 void keepWiFiAlive(void *parameters){
+  bool linkLost = false;
   for(;;){
     if(WiFi.status() == WL_CONNECTED){
-      Serial.println("[WIFI] Wifi still connected");
-      vTaskDelay(10000 / portTICK_PERIOD_MS);
+      logDebug("[WIFI] Wifi still connected");
+      txPowerAdapt();
+      linkLost = true;  // Seen up, so a later reconnect means it was lost
+      TickType_t lastWake = xTaskGetTickCount();
+      taskDelayUntil(&lastWake, &WIFI_CHECK_PERIOD_MS);
       continue;
     }
-    Serial.println("[WIFI] Wifi Connecting");
+#if MESH_MODE
+    if(meshHops > 0){
+      // Lost upstream: stop relaying so children cannot loop back through us
+      meshHops = 0;
+      uplink = directUplink;
+      // Turn the AP off; without wifioff it keeps beaconing, open and unnamed
+      WiFi.softAPdisconnect(true);
+    }
+#endif
+    // Scanning during a BLE session stalls provisioning writes, wait for it to end
+    unsigned long deferStart = millis();
+    while((radioActivity & ACT_PROVISIONING) && millis() - deferStart < COEX_MAX_DEFER_MS){
+      vTaskDelay(500 / portTICK_PERIOD_MS);
+    }
+    logLine("[WIFI] Wifi Connecting");
+    radioActivityBegin(ACT_WIFI_CONNECT);
+#if MESH_MODE
+    meshPrepareAP();
+#else
     WiFi.mode(WIFI_STA);
-    WiFi.begin(WIFI_NETWORK,WIFI_PASSWORD);
+#endif
+    txPowerReset(linkLost);
+    linkLost = false;
+#if UPLINK_TRANSPORT == UPLINK_ESPNOW
+    // Receive from neighbours before the first send
+    espNowUplink.begin();
+#endif
+    const char *passphrase = wifiPassphrase();
+    WiFi.begin(WIFI_NETWORK,passphrase);
     unsigned long startAttemptTime = millis();
     // Keep looping while we're not connected and haven't reached the timeout
-    while(WiFi.status() != WL_CONNECTED && millis() - startAttemptTime < WIFI_TIMEOUT_MS){}
+    while(WiFi.status() != WL_CONNECTED && millis() - startAttemptTime < WIFI_TIMEOUT_MS){
+      vTaskDelay(100 / portTICK_PERIOD_MS);
+    }
+    radioActivityEnd(ACT_WIFI_CONNECT);
     // When we could not make a Wifi connection
     if(WiFi.status() != WL_CONNECTED){
-      Serial.println("[WIFI] Failed");
-      vTaskDelay(20000 / portTICK_PERIOD_MS);
+      traceEvent(TRACE_WIFI_TIMEOUT, WiFi.status());
+      logLine("[WIFI] Failed");
+      if(passphrase != WIFI_PASSWORD && wifiApUsesSae()){
+        // WPA3-SAE won't take a PMK, retry right away with the passphrase
+        logLine("[WIFI] AP advertises SAE, using the passphrase");
+        wifiSaeCheck = wifiCredentialsCheck();
+        continue;
+      }
+#if MESH_MODE
+      // Out of AP range: go through a neighbour instead
+      if(meshJoin()){
+        continue;
+      }
+#endif
+      TickType_t lastWake = xTaskGetTickCount();
+      taskDelayUntil(&lastWake, &WIFI_RETRY_PERIOD_MS);
+      continue;
+    }
+    logLine("[WIFI] Connected: %s", WiFi.localIP().toString().c_str());
+#if MESH_MODE
+    meshHops = 1;
+    uplink = directUplink;
+    meshStartAP();
+#endif
+    publishMessage(CLASS_STATE, (const uint8_t *)"wifi:connected", 14);
+  }
+}
+/********************************************
+ * name: telemetryTask()
+ * parameters: none
+ * description: Samples device state into
+ * the telemetry queue. The oldest record is
+ * dropped when the queue is full.
+ ********************************************/
+void telemetryTask(void *parameters){
+  bool heapLow = false;
+  overloadRegister("telemetry sampling", LOAD_ELEVATED, [](bool on){ telemetryShed = on; });
+  for(;;){
+    TelemetryRecord record;
+    record.timestamp = millis();
+    record.freeHeap = ESP.getFreeHeap();
+    record.rssi = WiFi.status() == WL_CONNECTED ? WiFi.RSSI() : 0;
+    record.bleConnected = deviceConnected;
+    if(xQueueSend(telemetryQueue, &record, 0) != pdTRUE){
+      TelemetryRecord dropped;
+      xQueueReceive(telemetryQueue, &dropped, 0);
+      xQueueSend(telemetryQueue, &record, 0);
+    }
+    if(fsDataQueue != NULL){
+      xQueueSend(fsDataQueue, &record, 0);
+    }
+    if(record.freeHeap < LOW_HEAP_ALARM && !heapLow){
+      publishMessage(CLASS_ALARM, (const uint8_t *)"heap:low", 8);
+    }
+    heapLow = record.freeHeap < LOW_HEAP_ALARM;
+    vTaskDelay(TELEMETRY_PERIOD_MS * (telemetryShed ? TELEMETRY_SHED_FACTOR : 1) / portTICK_PERIOD_MS);
+  }
+}
+/********************************************
+ * name: uplinkTask()
+ * parameters: none
+ * description: Drains the outbound scheduler
+ * into the uplink. A message is only freed
+ * after it was acknowledged, so delivery is
+ * at-least-once; telemetry sequence numbers
+ * let the backend drop duplicates. A message
+ * the server rejects, or that still fails
+ * after UPLINK_MAX_ATTEMPTS, is dropped so
+ * it cannot hold up the classes behind it.
+ ********************************************/
+void uplinkTask(void *parameters){
+  OutboundMessage message;
+  bool inFlight = false;
+  int attempts = 0;
+  bool bulk = false;
+  for(;;){
+#if UPLINK_TRANSPORT == UPLINK_ESPNOW
+    EspNowUplink::poll();
+#endif
+    buildTelemetryBatch();
+    if(!inFlight){
+      inFlight = nextMessage(&message);
+      attempts = 0;
+    }
+    // Bulk coexistence only for a real backlog or a large message, with
+    // hysteresis so advertising isn't restarted around every send
+    int backlog = inFlight;
+    for(int i=0;i<CLASS_COUNT;i++){
+      backlog += uxQueueMessagesWaiting(classQueues[i]);
+    }
+    bool large = inFlight && message.length >= COEX_BULK_BYTES;
+    bool connected = WiFi.status() == WL_CONNECTED;
+    if(!bulk && connected && (large || backlog >= COEX_BULK_ENTER)){
+      radioActivityBegin(ACT_BULK);
+      bulk = true;
+    }
+    else if(bulk && (!connected || (!large && backlog <= COEX_BULK_EXIT))){
+      radioActivityEnd(ACT_BULK);
+      bulk = false;
+    }
+    if(!inFlight){
+      // Woken early by publishMessage()
+      ulTaskNotifyTake(pdTRUE, TELEMETRY_PERIOD_MS / portTICK_PERIOD_MS);
+      continue;
+    }
+    if(!connected){
+      vTaskDelay(UPLINK_RETRY_MS / portTICK_PERIOD_MS);
+      continue;
+    }
+    unsigned long sendStart = millis();
+    SendResult result = uplink->send(message.data, message.length);
+    radioOnMs += millis() - sendStart;
+    uplinkSends++;
+    attempts++;
+    if(result == SEND_REJECTED){
+      uplinkRejected++;
+      logLine("[UPLINK] %s message of %u bytes rejected, dropped", classConfig[message.messageClass].name, message.length);
+    }
+    else if(result == SEND_RETRY && attempts >= UPLINK_MAX_ATTEMPTS){
+      uplinkFailures++;
+      uplinkAbandoned++;
+      logLine("[UPLINK] %s message dropped after %d attempts", classConfig[message.messageClass].name, attempts);
+    }
+    else if(result == SEND_RETRY){
+      uplinkFailures++;
+      // Retry at full power, txPowerAdapt() steps back down
+      txPowerSet(0);
+      logLine("[UPLINK] No ack, retrying");
+      vTaskDelay(UPLINK_RETRY_MS / portTICK_PERIOD_MS);
+      continue;
+    }
+    else{
+      uplinkBytes += message.length;
+      logDebug("[UPLINK] Sent %s: %u bytes, latency %lu ms, radio %lu ms, total %lu bytes",
+              classConfig[message.messageClass].name, message.length, millis() - message.created, radioOnMs, uplinkBytes);
+    }
+    free(message.data);
+    inFlight = false;
+    adaptBatchSize();
+  }
+}
+/********************************************
+ * name: wsTask()
+ * parameters: none
+ * description: Serves the WebSocket stream
+ * of logs and metric deltas on WS_PORT.
+ ********************************************/
+void wsTask(void *parameters){
+  bool started = false;
+  unsigned long lastMetrics = 0;
+  overloadRegister("websocket metrics", LOAD_ELEVATED, [](bool on){ wsMetricsShed = on; });
+  for(;;){
+    if(WiFi.status() != WL_CONNECTED){
+      if(started){
+        // The listening socket dies with the link, open a new one on reconnect
+        for(int i=0;i<WS_MAX_CLIENTS;i++){
+          wsClients[i].client.stop();
+          wsClients[i].state = WS_FREE;
+        }
+        wsServer.end();
+        started = false;
+      }
+      vTaskDelay(1000 / portTICK_PERIOD_MS);
+      continue;
+    }
+    if(!started){
+      wsServer.begin();
+      started = true;
+    }
+    WiFiClient incoming = wsServer.available();
+    if(incoming){
+      wsAccept(incoming);
+    }
+    if(millis() - lastMetrics > WS_METRIC_PERIOD_MS && !wsMetricsShed){
+      wsMetrics();
+      lastMetrics = millis();
+    }
+    for(int i=0;i<WS_MAX_CLIENTS;i++){
+      if(wsClients[i].state == WS_HANDSHAKE){
+        wsHandshake(wsClients[i], i);
+      }
+      else if(wsClients[i].state == WS_OPEN){
+        wsPump(wsClients[i]);
+      }
+    }
+    vTaskDelay(20 / portTICK_PERIOD_MS);
+  }
+}
+/********************************************
+ * name: syslogTask()
+ * parameters: none
+ * description: Ships logs while WiFi is up.
+ * Otherwise they stay in the RTC log ring
+ * until the connection comes back.
+ ********************************************/
+void syslogTask(void *parameters){
+  for(;;){
+    if(WiFi.status() == WL_CONNECTED){
+      syslogFlush();
+    }
+    vTaskDelay(SYSLOG_PERIOD_MS / portTICK_PERIOD_MS);
+  }
+}
+/********************************************
+ * name: provisionTask()
+ * parameters: none
+ * description: Factory provisioning protocol
+ * on Serial1 at PROVISION_BAUD. Frames with
+ * a bad CRC are answered with status 1.
+ * Sleeps until the UART driver reports
+ * received bytes, as consoleTask() does.
+ ********************************************/
+void provisionTask(void *parameters){
+  static uint8_t payload[PROVISION_MAX_FRAME];
+  Serial1.setRxBufferSize(PROVISION_MAX_FRAME * 4);
+  Serial1.begin(PROVISION_BAUD, SERIAL_8N1, PROVISION_RX_PIN, PROVISION_TX_PIN);
+  Serial1.setTimeout(100);
+  Serial1.onReceive([](){ xTaskNotifyGive(provisionTaskHandle); });
+  for(;;){
+    if(Serial1.available() == 0){
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      continue;
+    }
+    if(Serial1.read() != PROVISION_SOF){
       continue;
     }
-    Serial.println("[WIFI] Connected: " + WiFi.localIP());
+    uint8_t header[3];
+    if(Serial1.readBytes(header, 3) != 3){
+      continue;
+    }
+    uint16_t length = header[1] | header[2] << 8;
+    uint32_t crc;
+    if(length > PROVISION_MAX_FRAME || Serial1.readBytes(payload, length) != length ||
+       Serial1.readBytes((uint8_t *)&crc, 4) != 4){
+      continue;
+    }
+    uint8_t check[PROVISION_MAX_FRAME + 3];
+    memcpy(check, header, 3);
+    memcpy(check + 3, payload, length);
+    if(crc32(check, length + 3) != crc){
+      uint8_t nak[5] = {1};
+      provisionReply(header[0] | PROVISION_REPLY, nak, sizeof(nak));
+      continue;
+    }
+    provisionHandle(header[0], payload, length);
+  }
+}
+/********************************************
+ * name: gatewayTask()
+ * parameters: none
+ * description: Keeps a passive scan running
+ * and batches new readings onto the uplink.
+ ********************************************/
+void gatewayTask(void *parameters){
+  static struct __attribute__((packed)) {
+    uint8_t type;
+    GatewayReading readings[GATEWAY_BATCH];
+  } batch;
+  batch.type = TELEMETRY_GATEWAY;
+  BLEScan *pScan = BLEDevice::getScan();
+  // Wanting duplicates, the scanner keeps no results list while it runs
+  pScan->setAdvertisedDeviceCallbacks(new MyGatewayCallbacks(), true);
+  pScan->setActiveScan(false);
+  // 50% duty cycle leaves airtime for the GATT server and WiFi
+  pScan->setInterval(160);
+  pScan->setWindow(80);
+  pScan->start(0, NULL, false);
+  bool scanning = true;
+  overloadRegister("gateway scan", LOAD_HIGH, [](bool on){ gatewayShed = on; });
+  int batchCount = 0;
+  unsigned long batchStart = millis();
+  unsigned long lastReport = millis();
+  for(;;){
+    if(gatewayShed == scanning){
+      // Suspended under load, the GATT server and uplink get the airtime
+      if(gatewayShed){
+        pScan->stop();
+        // Only safe while the BLE host isn't delivering results
+        pScan->clearResults();
+      }
+      else{
+        pScan->start(0, NULL, false);
+      }
+      scanning = !gatewayShed;
+    }
+    if(xQueueReceive(gatewayQueue, &batch.readings[batchCount], 1000 / portTICK_PERIOD_MS) == pdTRUE){
+      if(batchCount++ == 0){
+        batchStart = millis();
+      }
+    }
+    if(batchCount == GATEWAY_BATCH || (batchCount > 0 && millis() - batchStart > GATEWAY_MAX_AGE_MS)){
+      publishMessage(CLASS_TELEMETRY, (const uint8_t *)&batch, 1 + batchCount * sizeof(GatewayReading));
+      batchCount = 0;
+    }
+    if(millis() - lastReport > 10000){
+      unsigned long elapsed = millis() - lastReport;
+      logLine("[GATEWAY] %lu adverts/s, %lu duplicates, %lu dropped", gatewayAdverts * 1000 / elapsed,
+              gatewayDuplicates, gatewayDropped);
+      gatewayAdverts = 0;
+      gatewayDuplicates = 0;
+      gatewayDropped = 0;
+      lastReport = millis();
+    }
+  }
+}
+/********************************************
+ * name: meshTask()
+ * parameters: none
+ * description: Receives frames from mesh
+ * children and queues them upstream in the
+ * bounded relay class, and passes ACKs from
+ * our parent to the mesh uplink.
+ ********************************************/
+void meshTask(void *parameters){
+  static uint8_t frame[MESH_FRAME_SIZE];
+  unsigned long lastReport = millis();
+  meshUdp.begin(MESH_PORT);
+  for(;;){
+    int length = meshUdp.parsePacket();
+    if(length == 0){
+      vTaskDelay(10 / portTICK_PERIOD_MS);
+    }
+    else if(length == 2){
+      // ACK from our parent
+      uint8_t ack[2];
+      meshUdp.read(ack, 2);
+      meshUplink.meshAck = ack[0] | ack[1] << 8;
+    }
+    else if(length >= MESH_HEADER && length <= (int)sizeof(frame)){
+      meshUdp.read(frame, length);
+      uint32_t origin;
+      memcpy(&origin, frame, 4);
+      meshNoteDescendant(origin, meshUdp.remoteIP(), frame[4]);
+      if(meshHops > 0 && publishMessage(CLASS_RELAY, frame, length)){
+        meshUdp.beginPacket(meshUdp.remoteIP(), MESH_PORT);
+        meshUdp.write(frame + 5, 2);
+        meshUdp.endPacket();
+        meshRelayed++;
+        meshRelayBytes += length;
+      }
+      else{
+        meshRefused++;
+      }
+    }
+    else{
+      meshUdp.flush();
+      meshOversize += length > (int)sizeof(frame);
+    }
+    if(millis() - lastReport > 60000){
+      int descendants = 0;
+      for(int i=0;i<MESH_DESCENDANTS;i++){
+        descendants += meshDescendants[i].origin != 0 && millis() - meshDescendants[i].lastSeen < MESH_DESCENDANT_TTL_MS;
+      }
+      logLine("[MESH] Hops %u, %d descendants, relayed %lu (%lu bytes, %lu header), refused %lu, oversize %lu", meshHops,
+              descendants, meshRelayed, meshRelayBytes, meshRelayed * (MESH_HEADER + 1), meshRefused, meshOversize);
+      lastReport = millis();
+    }
+  }
+}
+/********************************************
+ * name: shadowTask()
+ * parameters: none
+ * description: Keeps the device shadow in
+ * sync while WiFi is connected.
+ ********************************************/
+void shadowTask(void *parameters){
+  for(;;){
+    if(WiFi.status() == WL_CONNECTED){
+      shadowSync();
+    }
+    vTaskDelay(SHADOW_PERIOD_MS / portTICK_PERIOD_MS);
+  }
+}
+/********************************************
+ * name: webTask()
+ * parameters: none
+ * description: Serves the local config UI
+ * from the assets partition.
+ ********************************************/
+void webTask(void *parameters){
+  const char *headers[] = {"If-None-Match", "Accept-Encoding"};
+  if(!assetsMap()){
+    vTaskDelete(NULL);
+  }
+  webServer.collectHeaders(headers, 2);
+  webServer.onNotFound(serveAsset);
+  while(WiFi.status() != WL_CONNECTED){
+    vTaskDelay(1000 / portTICK_PERIOD_MS);
+  }
+  webServer.begin();
+  for(;;){
+    webServer.handleClient();
+    vTaskDelay(5 / portTICK_PERIOD_MS);
+  }
+}
+/********************************************
+ * name: overloadTask()
+ * parameters: none
+ * description: Moves the load level up as
+ * soon as it is measured and down one step
+ * after OVERLOAD_COOLDOWN_MS of calm, and
+ * sheds or restores registered work.
+ ********************************************/
+void overloadTask(void *parameters){
+  TickType_t lastWake = xTaskGetTickCount();
+  unsigned long calmSince = millis();
+  for(;;){
+    uint8_t measured = overloadMeasure();
+    uint8_t level = loadLevel;
+    if(measured >= level){
+      level = measured;
+      calmSince = millis();
+    }
+    else if(millis() - calmSince > OVERLOAD_COOLDOWN_MS){
+      level--;
+      calmSince = millis();
+    }
+    if(level != loadLevel){
+      loadLevel = level;
+      logLine("[LOAD] %s: heap %u, queue %d%%, cpu %d%%/%d%%", loadNames[level], ESP.getFreeHeap(), loadQueue,
+              loadCpu[0], loadCpu[1]);
+      char event[20];
+      int length = snprintf(event, sizeof(event), "load:%s", loadNames[level]);
+      publishMessage(CLASS_STATE, (const uint8_t *)event, length);
+    }
+    portENTER_CRITICAL(&overloadMux);
+    int count = degradableCount;
+    portEXIT_CRITICAL(&overloadMux);
+    for(int i=0;i<count;i++){
+      Degradable &work = degradables[i];
+      bool shed = level >= work.level;
+      if(shed != work.shedding){
+        work.shedding = shed;
+        work.shed(shed);
+        logLine("[LOAD] %s %s", work.name, shed ? "shed" : "restored");
+      }
+    }
+    vTaskDelayUntil(&lastWake, OVERLOAD_PERIOD_MS / portTICK_PERIOD_MS);
+  }
+}
+/********************************************
+ * name: inputTask()
+ * parameters: none
+ * description: Debounces the edges from
+ * inputIsr() and detects short, long and
+ * double presses. Blocks until the next edge
+ * or the nearest pending deadline, so idle
+ * buttons cost no wakeups.
+ ********************************************/
+void inputTask(void *parameters){
+  struct InputState {
+    bool raw;                     // Level of the last edge
+    uint32_t rawTime;
+    bool settling;                // Waiting for the level to hold
+    bool pressed;                 // Debounced level
+    uint32_t pressTime;
+    bool longFired;
+    bool secondPress;
+    bool shortPending;            // Released, waiting for a second press
+    uint32_t releaseTime;
+  };
+  static InputState state[INPUT_COUNT];
+  for(int i=0;i<INPUT_COUNT;i++){
+    pinMode(inputPins[i].pin, INPUT_PULLUP);
+    attachInterruptArg(inputPins[i].pin, inputIsr, (void *)(uintptr_t)(inputPins[i].pin | i << 8), CHANGE);
+  }
+  for(;;){
+    uint32_t now = micros();
+    int32_t wait = INT32_MAX;
+    for(int i=0;i<INPUT_COUNT;i++){
+      InputState &input = state[i];
+      if(input.settling){
+        wait = min(wait, (int32_t)(input.rawTime + DEBOUNCE_MS * 1000 - now));
+      }
+      if(input.pressed && !input.longFired && !input.secondPress){
+        wait = min(wait, (int32_t)(input.pressTime + LONG_PRESS_MS * 1000 - now));
+      }
+      if(input.shortPending){
+        wait = min(wait, (int32_t)(input.releaseTime + DOUBLE_PRESS_MS * 1000 - now));
+      }
+    }
+    TickType_t ticks = portMAX_DELAY;
+    if(wait != INT32_MAX){
+      ticks = wait <= 0 ? 0 : wait / 1000 / portTICK_PERIOD_MS + 1;
+    }
+    InputEdge edge;
+    bool received = xQueueReceive(inputQueue, &edge, ticks) == pdTRUE;
+    unsigned long start = micros();
+    if(received){
+      inputEdges++;
+      state[edge.input].raw = edge.pressed;
+      state[edge.input].rawTime = edge.time;
+      state[edge.input].settling = true;
+    }
+    now = micros();
+    for(int i=0;i<INPUT_COUNT;i++){
+      InputState &input = state[i];
+      if(input.settling && (int32_t)(now - input.rawTime) >= DEBOUNCE_MS * 1000){
+        input.settling = false;
+        if(input.raw != input.pressed){
+          input.pressed = input.raw;
+          if(input.pressed){
+            input.secondPress = input.shortPending && input.rawTime - input.releaseTime < DOUBLE_PRESS_MS * 1000;
+            input.shortPending = false;
+            input.pressTime = input.rawTime;
+            input.longFired = false;
+          }
+          else if(input.secondPress){
+            input.secondPress = false;
+            inputGesture(i, GESTURE_DOUBLE, input.rawTime);
+          }
+          else if(!input.longFired){
+            input.shortPending = true;
+            input.releaseTime = input.rawTime;
+          }
+        }
+      }
+      if(input.pressed && !input.longFired && !input.secondPress &&
+         (int32_t)(now - input.pressTime) >= LONG_PRESS_MS * 1000){
+        input.longFired = true;
+        inputGesture(i, GESTURE_LONG, input.pressTime);
+      }
+      // A press still settling may turn this into a double press
+      if(input.shortPending && !input.settling &&
+         (int32_t)(now - input.releaseTime) >= DOUBLE_PRESS_MS * 1000){
+        input.shortPending = false;
+        inputGesture(i, GESTURE_SHORT, input.releaseTime);
+      }
+    }
+    inputBusyUs += micros() - start;
+  }
+}
+/********************************************
+ * name: fsTask()
+ * parameters: none
+ * description: Moves new log ring data and
+ * telemetry records into their journals and
+ * syncs them once per FS_PERIOD_MS, then
+ * spends at most FS_COMPACT_SLICE_MS on
+ * compaction unless the load is high.
+ ********************************************/
+void fsTask(void *parameters){
+  static char chunk[512];
+  unsigned long logLost = 0;
+  logJournal.begin();
+  dataJournal.begin();
+  overloadRegister("flash compaction", LOAD_HIGH, [](bool on){ fsCompactShed = on; });
+  TickType_t lastWake = xTaskGetTickCount();
+  for(;;){
+    bool overrun;
+    size_t length;
+    uint32_t before = fsLogCursor;
+    while((length = logRingRead(&fsLogCursor, chunk, sizeof(chunk), &overrun)) > 0){
+      if(overrun){
+        logLost += fsLogCursor - length - before;
+      }
+      logJournal.append((const uint8_t *)chunk, length);
+      before = fsLogCursor;
+    }
+    TelemetryRecord record;
+    while(xQueueReceive(fsDataQueue, &record, 0) == pdTRUE){
+      dataJournal.append((const uint8_t *)&record, sizeof(record));
+    }
+    logJournal.sync();
+    dataJournal.sync();
+    if(!fsCompactShed){
+      logJournal.compactStep(millis() + FS_COMPACT_SLICE_MS);
+    }
+    if(logLost > 0){
+      logLine("[FS] %lu log bytes overwritten before they reached flash", logLost);
+      logLost = 0;
+    }
+    vTaskDelayUntil(&lastWake, FS_PERIOD_MS / portTICK_PERIOD_MS);
+  }
+}
+/********************************************
+ * name: consoleTask()
+ * parameters: none
+ * description: Serial CLI with a small line
+ * editor, or COBS frames in framed mode.
+ * Sleeps until the UART driver reports
+ * received bytes, so an idle console costs
+ * no wakeups.
+ ********************************************/
+void consoleTask(void *parameters){
+  static char line[CONSOLE_LINE_LENGTH];
+  static uint8_t encoded[CONSOLE_FRAME_SIZE + CONSOLE_FRAME_SIZE / 254 + 2];
+  size_t lineLength = 0;
+  size_t encodedLength = 0;
+  bool overlong = false;
+  Serial.onReceive([](){ xTaskNotifyGive(consoleTaskHandle); });
+  for(;;){
+    while(Serial.available() > 0){
+      int c = Serial.read();
+      if(consoleFramed){
+        if(c != 0){
+          overlong |= encodedLength == sizeof(encoded);
+          if(!overlong){
+            encoded[encodedLength++] = c;
+          }
+          continue;
+        }
+        if(!overlong){
+          consoleFrame(encoded, encodedLength);
+        }
+        encodedLength = 0;
+        overlong = false;
+        continue;
+      }
+      if(c == '\r' || c == '\n'){
+        if(lineLength > 0){
+          Serial.print("\r\n");
+          line[lineLength] = 0;
+          lineLength = 0;
+          consoleExecute(line);
+        }
+      }
+      else if((c == '\b' || c == 0x7F) && lineLength > 0){
+        lineLength--;
+        Serial.print("\b \b");
+      }
+      else if(c >= ' ' && c < 0x7F && lineLength < sizeof(line) - 1){
+        line[lineLength++] = c;
+        Serial.write((uint8_t)c);
+      }
+    }
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
   }
 }
 void myTask(void *parameters){
+  TickType_t lastWake = xTaskGetTickCount();
   for(;;){
-    Serial.println("SUBSCRIBE FOR MORE TUTORIALS!");
-    vTaskDelay(2000 / portTICK_PERIOD_MS);
+    static const char message[] = "SUBSCRIBE FOR MORE TUTORIALS!\n";
+    consoleWrite(CHANNEL_LOG, (const uint8_t *)message, sizeof(message) - 1);
+    taskDelayUntil(&lastWake, &MY_TASK_PERIOD_MS);
   }
 }
 // Functions
@@ -197,46 +4635,95 @@ void getWiFiSettings(){
       }
     }
   }
-  Serial.print("[WIFI] Network: ");
-  Serial.print(WIFI_NETWORK);
-  Serial.println("");
-  Serial.print("[WIFI] Password: ");
-  Serial.print(WIFI_PASSWORD);
-  Serial.println("");
+  logLine("[WIFI] Network: %s", WIFI_NETWORK);
+  logLine("[WIFI] Password: %u characters", (unsigned)strlen(WIFI_PASSWORD));
 }
 
 void setup() {
   // Put your setup code here, to run once:
   Serial.begin(115200);
 
+  // Keep logs from before a reset
+  logRingInit();
+
+  // Dump the previous trace and record radio events from now on
+  traceInit();
+  WiFi.onEvent(traceWiFiEvent);
+
+  // Scale the CPU clock with the workload
+  powerInit();
+  txPowerMutex = xSemaphoreCreateRecursiveMutex();
+
   // Initialize EEPROM
+  eepromMutex = xSemaphoreCreateRecursiveMutex();
   EEPROM.begin(EEPROM_SIZE);
 
   // Get WiFi settings from EEPROM
   getWiFiSettings();
+  settingsLoad();
+
+  // Mount the log and data partition, formatting it on first boot
+  uint32_t heapBefore = ESP.getFreeHeap();
+  unsigned long mountStart = millis();
+  // maxOpenFiles (10) is not forwarded; the cache budget is in sdkconfig.defaults
+  fsMounted = LittleFS.begin(true, "/littlefs", 10, FS_PARTITION);
+  if(fsMounted){
+    logLine("[FS] Mounted in %lu ms, %u of %u bytes used, %u bytes RAM", millis() - mountStart,
+            (unsigned)LittleFS.usedBytes(), (unsigned)LittleFS.totalBytes(), heapBefore - ESP.getFreeHeap());
+    fsDataQueue = xQueueCreate(FS_DATA_QUEUE_LEN, sizeof(TelemetryRecord));
+  }
+  else{
+    logLine("[FS] No %s partition, logs stay in RAM", FS_PARTITION);
+  }
+
+  // Queue between telemetry sampling and the uplink
+  telemetryQueue = xQueueCreate(TELEMETRY_QUEUE_LEN, sizeof(TelemetryRecord));
+  for(int i=0;i<CLASS_COUNT;i++){
+    classQueues[i] = xQueueCreate(classConfig[i].queueLimit, sizeof(OutboundMessage));
+  }
   
   // Create the BLE Device
+  coexMutex = xSemaphoreCreateMutex();
   BLEDevice::init(BLESERVERNAME);
+  // Largest ATT MTU we accept when the central starts the exchange
+  BLEDevice::setMTU(BLE_MTU);
+  bleIdleTimer = xTimerCreate("BLE idle", BLE_IDLE_MS / portTICK_PERIOD_MS, pdFALSE, NULL, bleIdle);
 
   // Create the BLE Server
   BLEServer *pServer = BLEDevice::createServer();
+  bleServer = pServer;
   pServer->setCallbacks(new MyServerCallbacks());
   BLEService *pService = pServer->createService(SERVICE_UUID);
+  // Write without response lets provisioning tools pipeline writes
   BLECharacteristic *networkCharacteristic = pService->createCharacteristic(
                                          NETWORK_UUID,
                                          BLECharacteristic::PROPERTY_READ |
-                                         BLECharacteristic::PROPERTY_WRITE
+                                         BLECharacteristic::PROPERTY_WRITE |
+                                         BLECharacteristic::PROPERTY_WRITE_NR
                                        );
   BLECharacteristic *passwordCharacteristic = pService->createCharacteristic(
                                          PASSWORD_UUID,
                                          BLECharacteristic::PROPERTY_READ |
+                                         BLECharacteristic::PROPERTY_WRITE |
+                                         BLECharacteristic::PROPERTY_WRITE_NR
+                                       );
+  statusCharacteristic = pService->createCharacteristic(
+                                         STATUS_UUID,
+                                         BLECharacteristic::PROPERTY_READ |
+                                         BLECharacteristic::PROPERTY_NOTIFY
+                                       );
+  statusCharacteristic->addDescriptor(new BLE2902());
+  BLECharacteristic *configCharacteristic = pService->createCharacteristic(
+                                         CONFIG_UUID,
                                          BLECharacteristic::PROPERTY_WRITE
                                        );
+  configCharacteristic->setCallbacks(new MyConfigCallbacks());
   networkCharacteristic->setCallbacks(new MyNetworkCallbacks());
   passwordCharacteristic->setCallbacks(new MyPasswordCallbacks());
   networkCharacteristic->setValue(WIFI_NETWORK);
   passwordCharacteristic->setValue(WIFI_PASSWORD);
   pService->start();
+  notifyProvisionStatus("boot", true);
   BLEAdvertising *pAdvertising = BLEDevice::getAdvertising();
   pAdvertising->addServiceUUID(SERVICE_UUID);
   pAdvertising->setScanResponse(true);
@@ -248,10 +4735,10 @@ void setup() {
   xTaskCreatePinnedToCore(
     bleStatus,    // Function to be called
     "Bluetooth status", // Name of task
-    1024,         // Stack size. bytes
+    3072,         // Stack size. bytes, room for the timer work
     NULL,         // Parameter to pass to function
     3,            // Task priority
-    NULL,         // Task handle
+    &bleStatusHandle, // Task handle
     app_cpu);     // Run
   // Task for WiFi
   xTaskCreatePinnedToCore(
@@ -260,17 +4747,146 @@ void setup() {
     4024,         // Stack size. bytes
     NULL,         // Parameter to pass to function
     2,            // Task priority
-    NULL,         // Task handle
+    &keepWiFiAliveHandle, // Task handle
     app_cpu);     // Run
   // Personal task
   xTaskCreatePinnedToCore(
     myTask,       // Function to be called
     "My Task",    // Name of task
-    1024,         // Stack size. bytes
+    2048,         // Stack size. bytes (a framed console write builds its COBS frame on the stack)
+    NULL,         // Parameter to pass to function
+    1,            // Task priority
+    &myTaskHandle, // Task handle
+    app_cpu);     // Run
+  // Task for telemetry sampling
+  xTaskCreatePinnedToCore(
+    telemetryTask, // Function to be called
+    "Telemetry",  // Name of task
+    2048,         // Stack size. bytes
+    NULL,         // Parameter to pass to function
+    1,            // Task priority
+    NULL,         // Task handle
+    app_cpu);     // Run
+  // Task for the uplink
+  xTaskCreatePinnedToCore(
+    uplinkTask,   // Function to be called
+    "Uplink",     // Name of task
+    6144,         // Stack size. bytes
+    NULL,         // Parameter to pass to function
+    1,            // Task priority
+    &uplinkTaskHandle, // Task handle
+    app_cpu);     // Run
+  // Task for the WebSocket stream
+  xTaskCreatePinnedToCore(
+    wsTask,       // Function to be called
+    "WebSocket",  // Name of task
+    4096,         // Stack size. bytes
+    NULL,         // Parameter to pass to function
+    1,            // Task priority
+    NULL,         // Task handle
+    app_cpu);     // Run
+#if GATEWAY_MODE
+  // Task for the BLE gateway
+  gatewayQueue = xQueueCreate(GATEWAY_QUEUE_LEN, sizeof(GatewayReading));
+  xTaskCreatePinnedToCore(
+    gatewayTask,  // Function to be called
+    "Gateway",    // Name of task
+    4096,         // Stack size. bytes
+    NULL,         // Parameter to pass to function
+    1,            // Task priority
+    NULL,         // Task handle
+    app_cpu);     // Run
+#endif
+#if MESH_MODE
+  // Task for the mesh relay
+  xTaskCreatePinnedToCore(
+    meshTask,     // Function to be called
+    "Mesh",       // Name of task
+    4096,         // Stack size. bytes
+    NULL,         // Parameter to pass to function
+    1,            // Task priority
+    NULL,         // Task handle
+    app_cpu);     // Run
+#endif
+#if FACTORY_PROVISION
+  // Task for factory provisioning
+  xTaskCreatePinnedToCore(
+    provisionTask, // Function to be called
+    "Provisioning", // Name of task
+    3072,         // Stack size. bytes
+    NULL,         // Parameter to pass to function
+    2,            // Task priority
+    &provisionTaskHandle, // Task handle
+    app_cpu);     // Run
+#endif
+  // Task for the device shadow
+  xTaskCreatePinnedToCore(
+    shadowTask,   // Function to be called
+    "Shadow",     // Name of task
+    6144,         // Stack size. bytes
+    NULL,         // Parameter to pass to function
+    1,            // Task priority
+    NULL,         // Task handle
+    app_cpu);     // Run
+  // Task for the local web UI
+  xTaskCreatePinnedToCore(
+    webTask,      // Function to be called
+    "Web",        // Name of task
+    4096,         // Stack size. bytes
+    NULL,         // Parameter to pass to function
+    1,            // Task priority
+    NULL,         // Task handle
+    app_cpu);     // Run
+  // Task for remote syslog
+  xTaskCreatePinnedToCore(
+    syslogTask,   // Function to be called
+    "Syslog",     // Name of task
+    4096,         // Stack size. bytes
     NULL,         // Parameter to pass to function
     1,            // Task priority
     NULL,         // Task handle
     app_cpu);     // Run
+  // Task for the overload controller
+  overloadRegister("debug logs", LOAD_ELEVATED, [](bool on){ logShed = on; });
+  xTaskCreatePinnedToCore(
+    overloadTask, // Function to be called
+    "Overload",   // Name of task
+    3072,         // Stack size. bytes
+    NULL,         // Parameter to pass to function
+    3,            // Task priority
+    NULL,         // Task handle
+    app_cpu);     // Run
+  // Task for buttons and GPIO triggers
+  inputQueue = xQueueCreate(INPUT_QUEUE_LEN, sizeof(InputEdge));
+  provisionWindowTimer = xTimerCreate("Provision window", PROVISION_WINDOW_MS / portTICK_PERIOD_MS, pdFALSE, NULL, provisionWindowEnd);
+  xTaskCreatePinnedToCore(
+    inputTask,    // Function to be called
+    "Input",      // Name of task
+    3072,         // Stack size. bytes
+    NULL,         // Parameter to pass to function
+    2,            // Task priority
+    NULL,         // Task handle
+    app_cpu);     // Run
+  // Task for the log and data partition
+  if(fsMounted){
+    xTaskCreatePinnedToCore(
+      fsTask,       // Function to be called
+      "Storage",    // Name of task
+      6144,         // Stack size. bytes
+      NULL,         // Parameter to pass to function
+      1,            // Task priority
+      NULL,         // Task handle
+      app_cpu);     // Run
+  }
+  // Task for the serial console
+  xTaskCreatePinnedToCore(
+    consoleTask,  // Function to be called
+    "Console",    // Name of task
+    4096,         // Stack size. bytes
+    NULL,         // Parameter to pass to function
+    1,            // Task priority
+    &consoleTaskHandle, // Task handle
+    app_cpu);     // Run
 }
 
 void loop() {
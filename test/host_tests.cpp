@@ -0,0 +1,442 @@
+/***********************************************
+ * Host unit tests for the firmware's pure
+ * logic: compression, the outbound scheduler,
+ * the shadow's JSON handling, console framing,
+ * the syslog resync and button gestures.
+ * main.cpp is compiled as is against the
+ * stand-ins in stubs/.
+ *
+ * Build and run: make -C test
+ */
+#include "../main.cpp"
+
+int checks = 0;
+int failures = 0;
+#define CHECK(condition) do{ \
+    checks++; \
+    if(!(condition)){ \
+      failures++; \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+    } \
+  }while(0)
+
+// Helpers
+/********************************************
+ * name: lzDecompress()
+ * parameters: in, length
+ * description: Reference decoder for the
+ * lzCompress() format.
+ ********************************************/
+std::vector<uint8_t> lzDecompress(const uint8_t *in, size_t length){
+  std::vector<uint8_t> out;
+  size_t pos = 0;
+  while(pos < length){
+    uint8_t flags = in[pos++];
+    for(int bit=0;bit<8 && pos<length;bit++){
+      if(flags & (1 << bit)){
+        size_t distance = in[pos] << 4 | in[pos+1] >> 4;
+        size_t matchLength = (in[pos+1] & 0x0F) + 3;
+        pos += 2;
+        for(size_t i=0;i<matchLength;i++){
+          out.push_back(out[out.size() - distance]);
+        }
+      }
+      else{
+        out.push_back(in[pos++]);
+      }
+    }
+  }
+  return out;
+}
+/********************************************
+ * name: cobsEncode(), cobsDecode()
+ * parameters: data
+ * description: Reference COBS, without and
+ * with the 0x00 delimiter respectively.
+ ********************************************/
+std::string cobsEncode(const std::string &data){
+  std::string out(1, 0);
+  size_t code = 0;
+  for(char c : data){
+    if(c == 0){
+      out[code] = out.size() - code;
+      code = out.size();
+      out.push_back(0);
+      continue;
+    }
+    out.push_back(c);
+    if(out.size() - code == 0xFF){
+      out[code] = (char)0xFF;
+      code = out.size();
+      out.push_back(0);
+    }
+  }
+  out[code] = out.size() - code;
+  return out;
+}
+std::string cobsDecode(const std::string &frame){
+  std::string out;
+  size_t end = frame.find('\0');
+  for(size_t i=0;i<end;){
+    uint8_t code = frame[i++];
+    out.append(frame, i, code - 1);
+    i += code - 1;
+    if(code != 0xFF && i < end){
+      out.push_back(0);
+    }
+  }
+  return out;
+}
+// Queued messages of one class, without the class byte
+std::vector<std::string> drainClass(uint8_t messageClass){
+  std::vector<std::string> messages;
+  OutboundMessage message;
+  while(xQueueReceive(classQueues[messageClass], &message, 0) == pdTRUE){
+    messages.push_back(std::string((const char *)message.data + 1, message.length - 1));
+    free(message.data);
+  }
+  return messages;
+}
+
+// Tests
+void testLzCompress(){
+  uint8_t out[UPLINK_BUFFER_SIZE];
+  std::string text;
+  for(int i=0;i<40;i++){
+    text += "temperature=21." + std::to_string(i % 3) + ";";
+  }
+  size_t length = lzCompress((const uint8_t *)text.data(), text.size(), out, sizeof(out));
+  CHECK(length > 0 && length < text.size() / 3);
+  std::vector<uint8_t> decoded = lzDecompress(out, length);
+  CHECK(std::string(decoded.begin(), decoded.end()) == text);
+  // Incompressible records still round-trip, or report that they don't fit
+  uint8_t records[BATCH_MAX_RECORDS * sizeof(TelemetryRecord)];
+  for(size_t i=0;i<sizeof(records);i++){
+    records[i] = esp_random();
+  }
+  length = lzCompress(records, sizeof(records), out, sizeof(out));
+  CHECK(length > 0);
+  decoded = lzDecompress(out, length);
+  CHECK(decoded.size() == sizeof(records) && memcmp(decoded.data(), records, sizeof(records)) == 0);
+  CHECK(lzCompress(records, sizeof(records), out, 64) == 0);
+  // Long runs use the longest match and overlapping copies
+  uint8_t run[600];
+  memset(run, 'a', sizeof(run));
+  length = lzCompress(run, sizeof(run), out, sizeof(out));
+  decoded = lzDecompress(out, length);
+  CHECK(decoded.size() == sizeof(run) && memcmp(decoded.data(), run, sizeof(run)) == 0);
+}
+void testScheduler(){
+  for(int i=0;i<CLASS_COUNT;i++){
+    drainClass(i);
+  }
+  // An alarm behind a full telemetry backlog goes out within a few messages
+  uint8_t payload[600] = {0};
+  for(int i=0;i<classConfig[CLASS_TELEMETRY].queueLimit;i++){
+    payload[0] = i;
+    CHECK(publishMessage(CLASS_TELEMETRY, payload, sizeof(payload)));
+  }
+  CHECK(publishMessage(CLASS_ALARM, (const uint8_t *)"heap:low", 8));
+  OutboundMessage message;
+  int position = -1;
+  for(int i=0;i<4 && position < 0;i++){
+    CHECK(nextMessage(&message));
+    if(message.messageClass == CLASS_ALARM){
+      position = i;
+    }
+    free(message.data);
+  }
+  CHECK(position >= 0);
+  drainClass(CLASS_TELEMETRY);
+  CHECK(!nextMessage(&message));
+  // Drop oldest: the newest state wins
+  unsigned long dropped = classDropped[CLASS_STATE];
+  for(int i=0;i<=classConfig[CLASS_STATE].queueLimit;i++){
+    std::string state = "state:" + std::to_string(i);
+    CHECK(publishMessage(CLASS_STATE, (const uint8_t *)state.data(), state.size()));
+  }
+  std::vector<std::string> states = drainClass(CLASS_STATE);
+  CHECK(classDropped[CLASS_STATE] == dropped + 1);
+  CHECK(states.size() == classConfig[CLASS_STATE].queueLimit && states.front() == "state:1");
+  // Drop newest: queued alarms are never replaced
+  dropped = classDropped[CLASS_ALARM];
+  for(int i=0;i<classConfig[CLASS_ALARM].queueLimit;i++){
+    CHECK(publishMessage(CLASS_ALARM, (const uint8_t *)"a", 1));
+  }
+  CHECK(!publishMessage(CLASS_ALARM, (const uint8_t *)"b", 1));
+  CHECK(classDropped[CLASS_ALARM] == dropped + 1);
+  std::vector<std::string> alarms = drainClass(CLASS_ALARM);
+  CHECK(alarms.size() == classConfig[CLASS_ALARM].queueLimit && alarms.back() == "a");
+  // Per round, state (weight 4) gets four times the bytes of log (weight 1)
+  for(int i=0;i<12;i++){
+    CHECK(publishMessage(CLASS_LOG, payload, DRR_QUANTUM - 1));
+    CHECK(publishMessage(CLASS_STATE, payload, DRR_QUANTUM - 1));
+  }
+  int sent[CLASS_COUNT] = {0};
+  for(int i=0;i<10;i++){
+    CHECK(nextMessage(&message));
+    sent[message.messageClass]++;
+    free(message.data);
+  }
+  CHECK(sent[CLASS_STATE] == 8 && sent[CLASS_LOG] == 2);
+  drainClass(CLASS_LOG);
+  drainClass(CLASS_STATE);
+}
+void testJson(){
+  char out[SETTINGS_LENGTH];
+  bool isNull;
+  const char *text = " \"a\\\"b\\\\\\n\\u00e9\\u20ac\" ,";
+  CHECK(jsonString(&text, out, sizeof(out), &isNull));
+  CHECK(strcmp(out, "a\"b\\\n\xC3\xA9\xE2\x82\xAC") == 0 && !isNull && strcmp(text, " ,") == 0);
+  text = "null}";
+  CHECK(jsonString(&text, out, sizeof(out), &isNull) && isNull && *text == '}');
+  text = "15000,";
+  CHECK(jsonString(&text, out, sizeof(out), &isNull) && strcmp(out, "15000") == 0 && !isNull);
+  text = "\"\"";
+  CHECK(jsonString(&text, out, sizeof(out), &isNull) && out[0] == 0);
+  // Too long, bad escapes and surrogates fail instead of being cut
+  text = "\"abcdef\"";
+  CHECK(!jsonString(&text, out, 4, &isNull));
+  text = "\"a\\x\"";
+  CHECK(!jsonString(&text, out, sizeof(out), &isNull));
+  text = "\"\\u12\"";
+  CHECK(!jsonString(&text, out, sizeof(out), &isNull));
+  text = "\"\\ud83d\\ude00\"";
+  CHECK(!jsonString(&text, out, sizeof(out), &isNull));
+  text = "\"open";
+  CHECK(!jsonString(&text, out, sizeof(out), &isNull));
+  // A merge patch changes what differs, with one commit
+  uint32_t bleStatus = BLE_STATUS_PERIOD_MS;
+  int commits = EEPROM.commits;
+  CHECK(shadowApply("{\"wifi_check\": \"15000\", \"ble_status\": null, \"unknown\": \"1\"}") == 1);
+  CHECK(WIFI_CHECK_PERIOD_MS == 15000 && BLE_STATUS_PERIOD_MS == bleStatus);
+  CHECK(EEPROM.commits == commits + 1);
+  CHECK(shadowApply("{\"wifi_check\": 15000}") == 0 && EEPROM.commits == commits + 1);
+  // Out of range and malformed values are refused
+  CHECK(shadowApply("{\"wifi_check\": \"0\"}") == 0 && WIFI_CHECK_PERIOD_MS == 15000);
+  CHECK(shadowApply("{\"my_task\": \"\\q\", \"wifi_check\": \"20000\"}") == 0 && WIFI_CHECK_PERIOD_MS == 15000);
+  CHECK(shadowApply("no document") == 0);
+  // The plain HTTP shadow cannot move the device to another network
+  std::string network = WIFI_NETWORK;
+  std::string password = WIFI_PASSWORD;
+  CHECK(shadowApply("{\"network\": \"evil\", \"password\": \"evil\", \"my_task\": \"3000\"}") == 1);
+  CHECK(network == WIFI_NETWORK && password == WIFI_PASSWORD && MY_TASK_PERIOD_MS == 3000);
+}
+void testConsoleFrames(){
+  consoleFramed = true;
+  // A 0xFF run, zeros at both ends and the zero channel byte
+  std::string payload(1, 0);
+  payload += std::string(253, 'x');
+  payload.push_back(0);
+  Serial.output.clear();
+  consoleWrite(CHANNEL_LOG, (const uint8_t *)payload.data(), payload.size());
+  std::string frame = Serial.output;
+  CHECK(frame.find('\0') == frame.size() - 1);
+  CHECK(cobsDecode(frame) == std::string(1, CHANNEL_LOG) + payload);
+  // Longer writes are cut to one frame
+  std::string big(CONSOLE_FRAME_SIZE * 2, 'y');
+  Serial.output.clear();
+  consoleWrite(CHANNEL_CLI, (const uint8_t *)big.data(), big.size());
+  CHECK(cobsDecode(Serial.output).size() == CONSOLE_FRAME_SIZE);
+  // RPC round trip through the decoder
+  std::string request = cobsEncode(std::string(1, CHANNEL_RPC) + (char)RPC_DIGEST);
+  Serial.output.clear();
+  consoleFrame((const uint8_t *)request.data(), request.size());
+  std::string reply = cobsDecode(Serial.output);
+  uint32_t digest = settingsDigest();
+  CHECK(reply.size() == 7 && reply[0] == CHANNEL_RPC && (uint8_t)reply[1] == (RPC_DIGEST | RPC_REPLY) && reply[2] == 0);
+  CHECK(reply.size() == 7 && memcmp(reply.data() + 3, &digest, 4) == 0);
+  request = cobsEncode(std::string(1, CHANNEL_RPC) + (char)RPC_GET_SETTING + "password");
+  Serial.output.clear();
+  consoleFrame((const uint8_t *)request.data(), request.size());
+  reply = cobsDecode(Serial.output);
+  CHECK(reply.size() == 3 && reply[2] == 4);
+  // Malformed frames are dropped
+  Serial.output.clear();
+  consoleFrame((const uint8_t *)"\x05\x02", 2);
+  CHECK(Serial.output.empty());
+  consoleFramed = false;
+}
+void testSyslogResync(){
+  // Caught up with everything logged so far
+  syslogCursor = logHead;
+  syslogSequence = logLines;
+  hostDatagrams.clear();
+  uint32_t base = logLines;
+  for(int i=0;i<3;i++){
+    logLine("[TEST] line %d", i);
+  }
+  syslogFlush();
+  CHECK(hostDatagrams.size() == 3);
+  for(size_t i=0;i<hostDatagrams.size();i++){
+    std::string expected = "sequenceId=\"" + std::to_string(base + i + 1) + "\"] [TEST] line " + std::to_string(i);
+    CHECK(hostDatagrams[i].find(expected) != std::string::npos);
+  }
+  // Offline long enough for the ring to wrap: the first datagram after
+  // it is a whole line, numbered as if nothing had been lost
+  base = logLines;
+  for(int i=0;i<100;i++){
+    logLine("[TEST] line %d of the wrap test, padded to make it longer", i);
+  }
+  hostDatagrams.clear();
+  syslogFlush();
+  CHECK(hostDatagrams.size() > 10 && hostDatagrams.size() < 100);
+  for(const std::string &datagram : hostDatagrams){
+    unsigned sequence;
+    int line;
+    const char *meta = strstr(datagram.c_str(), "sequenceId=");
+    CHECK(meta != NULL && sscanf(meta, "sequenceId=\"%u\"] [TEST] line %d of", &sequence, &line) == 2);
+    CHECK(meta != NULL && sequence == base + line + 1);
+  }
+  CHECK(hostDatagrams.back().find("line 99 of") != std::string::npos);
+  CHECK(syslogCursor == logHead && syslogSequence == logLines);
+}
+/********************************************
+ * name: gestures()
+ * parameters: edges (ms, pressed)
+ * description: Runs inputTask() on a script
+ * of edges, from now, until it has been
+ * idle for a while, and returns what it
+ * published.
+ ********************************************/
+std::vector<std::string> gestures(const std::vector<std::pair<int, bool>> &edges, bool *restarted){
+  uint64_t start = hostMicros;
+  size_t next = 0;
+  *restarted = false;
+  drainClass(CLASS_STATE);
+  hostTick = [&](){
+    bool queued = false;
+    while(next < edges.size() && hostMicros >= start + edges[next].first * 1000ULL){
+      InputEdge edge = {(uint32_t)(start + edges[next].first * 1000ULL), 0, edges[next].second};
+      xQueueSend(inputQueue, &edge, 0);
+      queued = true;
+      next++;
+    }
+    if(next == edges.size() && hostMicros > start + (edges.back().first + LONG_PRESS_MS + 1000) * 1000ULL){
+      throw HostStop();
+    }
+    return queued;
+  };
+  try{
+    inputTask(NULL);
+  }
+  catch(HostStop &){
+  }
+  catch(HostRestart &){
+    *restarted = true;
+  }
+  hostTick = nullptr;
+  std::vector<std::string> published;
+  for(const std::string &message : drainClass(CLASS_STATE)){
+    if(message.compare(0, 6, "input:") == 0){
+      published.push_back(message);
+    }
+  }
+  return published;
+}
+void testCommitFailure(){
+  // Every path that commits reports a failed flash write
+  hostEepromFail = true;
+  hostBleServer.service.hostFind(NETWORK_UUID)->hostWrite("lab");
+  CHECK(!hostBleNotified.empty() && hostBleNotified.back() == "network:error");
+  hostBleServer.service.hostFind(CONFIG_UUID)->hostWrite("ble_status=2000");
+  CHECK(!hostBleNotified.empty() && hostBleNotified.back() == "config:error");
+  Serial1.output.clear();
+  uint8_t set[] = "lab\0secret";
+  provisionHandle(PROVISION_SET, set, sizeof(set));
+  CHECK(Serial1.output.size() == 13 && (uint8_t)Serial1.output[1] == (PROVISION_SET | PROVISION_REPLY) && Serial1.output[4] == 4);
+  std::string request = cobsEncode(std::string(1, CHANNEL_RPC) + (char)RPC_SET_SETTING + "ble_status" + '\0' + "3000");
+  consoleFramed = true;
+  Serial.output.clear();
+  consoleFrame((const uint8_t *)request.data(), request.size());
+  // The reply follows the log frames
+  size_t last = Serial.output.rfind('\0', Serial.output.size() - 2);
+  std::string reply = cobsDecode(Serial.output.substr(last == std::string::npos ? 0 : last + 1));
+  CHECK(reply.size() == 3 && reply[0] == CHANNEL_RPC && reply[2] == 5);
+  consoleFramed = false;
+  hostEepromFail = false;
+  hostBleServer.service.hostFind(CONFIG_UUID)->hostWrite("ble_status=" + std::to_string(BLE_STATUS_PERIOD_MS));
+  char expected[32];
+  snprintf(expected, sizeof(expected), "config:%08x", (unsigned)settingsDigest());
+  CHECK(hostBleNotified.back() == expected);
+}
+void testSecretsNotLogged(){
+  Serial.output.clear();
+  hostBleServer.service.hostFind(NETWORK_UUID)->hostWrite("home");
+  hostBleServer.service.hostFind(PASSWORD_UUID)->hostWrite("hunter2-secret");
+  hostBleServer.service.hostFind(CONFIG_UUID)->hostWrite("password=other-secret");
+  CHECK(strcmp(WIFI_NETWORK, "home") == 0 && strcmp(WIFI_PASSWORD, "other-secret") == 0);
+  // The network is logged once, as a whole, and no password at all
+  CHECK(Serial.output.find("home") != std::string::npos && Serial.output.find("h\r\n") == std::string::npos);
+  CHECK(Serial.output.find("secret") == std::string::npos);
+}
+void testBleTimers(){
+  // The timer callbacks only hand the work to bleStatus()
+  radioActivityBegin(ACT_PROVISIONING);
+  provisionWindowEnd(NULL);
+  CHECK(radioActivity & ACT_PROVISIONING);
+  hostTick = []() -> bool { throw HostStop(); };
+  try{
+    bleStatus(NULL);
+  }
+  catch(HostStop &){
+  }
+  hostTick = nullptr;
+  CHECK(!(radioActivity & ACT_PROVISIONING));
+}
+void testPowerFixedClock(){
+  // Without esp_pm boosts are only recorded, the clock stays put
+  uint32_t mhz = hostCpuMhz;
+  unsigned long boosts = boostCount[BOOST_CRYPTO];
+  powerBoostBegin(BOOST_CRYPTO);
+  CHECK(hostCpuMhz == mhz && boostTotal > 0);
+  powerBoostEnd(BOOST_CRYPTO);
+  CHECK(hostCpuMhz == mhz && boostCount[BOOST_CRYPTO] == boosts + 1);
+}
+void testTlsInit(){
+  // A failed init frees its contexts and is tried again on the next send
+  HttpsUplink https;
+  int live = hostTlsLive;
+  hostTlsSeedResult = -1;
+  CHECK(https.send((const uint8_t *)"x", 1) == SEND_RETRY);
+  CHECK(hostTlsLive == live);
+  CHECK(https.send((const uint8_t *)"x", 1) == SEND_RETRY);
+  CHECK(hostTlsLive == live);
+  hostTlsSeedResult = 0;
+}
+void testGestures(){
+  bool restarted;
+  std::vector<std::string> shortPress = {"input:boot:short"};
+  CHECK(gestures({{0, true}, {150, false}}, &restarted) == shortPress);
+  // Contact bounce on press and release
+  CHECK(gestures({{0, true}, {3, false}, {6, true}, {200, false}, {203, true}, {205, false}}, &restarted) == shortPress);
+  std::vector<std::string> doublePress = {"input:boot:double"};
+  CHECK(gestures({{0, true}, {100, false}, {250, true}, {350, false}}, &restarted) == doublePress);
+  // Second press after the double press window: two short presses
+  std::vector<std::string> twoShort = {"input:boot:short", "input:boot:short"};
+  CHECK(gestures({{0, true}, {100, false}, {100 + DOUBLE_PRESS_MS + 200, true}, {200 + DOUBLE_PRESS_MS + 200, false}},
+                 &restarted) == twoShort);
+  // A long press fires while still held and ends in a factory reset
+  std::vector<std::string> longPress = {"input:boot:long"};
+  CHECK(gestures({{0, true}, {LONG_PRESS_MS + 1000, false}}, &restarted) == longPress);
+  CHECK(restarted);
+}
+
+int main(){
+  setup();
+  Serial.output.clear();
+  testLzCompress();
+  testScheduler();
+  testJson();
+  testConsoleFrames();
+  testSyslogResync();
+  testCommitFailure();
+  testSecretsNotLogged();
+  testBleTimers();
+  testPowerFixedClock();
+  testTlsInit();
+  // Last, it ends in a factory reset
+  testGestures();
+  printf("%d checks, %d failed\n", checks, failures);
+  return failures > 0;
+}
@@ -0,0 +1,265 @@
+/***********************************************
+ * Replays a radio/HAL event trace against the
+ * firmware. The WiFi, BLE and input events a
+ * device recorded with traceEvent() drive
+ * keepWiFiAlive(), the BLE callbacks and the
+ * BLE timers on the virtual clock, so a field
+ * trace replays deterministically and far
+ * faster than real time. What the firmware
+ * decides by itself (TRACE_WIFI_TIMEOUT) is
+ * recorded again and compared with the trace.
+ *
+ * The trace is the UART capture of a boot:
+ * traceInit() dumps the previous boots as
+ * "[TRACE] <time> <type> <arg>" lines. Each
+ * TRACE_BOOT starts a boot; the last one is
+ * the boot that ended in the restart.
+ *
+ * Usage: replay [-d] [-v] [-b boot] trace.txt
+ *   -d       decode only
+ *   -v       print each event and the firmware log
+ *   -b boot  boot to replay, from 0; default the last
+ * Exits 1 when the WiFi timeouts differ.
+ */
+#include "../main.cpp"
+#include <chrono>
+#include <unistd.h>
+
+const char *traceTypeNames[] = {"BOOT", "WIFI_EVENT", "WIFI_TIMEOUT", "BLE_CONNECT", "BLE_DISCONNECT", "BLE_WRITE", "INPUT"};
+const char *wifiEventNames[] = {"WIFI_READY", "SCAN_DONE", "STA_START", "STA_STOP", "STA_CONNECTED", "STA_DISCONNECTED",
+                                "STA_AUTHMODE_CHANGE", "STA_GOT_IP", "STA_GOT_IP6", "STA_LOST_IP", "AP_START", "AP_STOP"};
+const char *wifiStatusNames[] = {"IDLE", "NO_SSID_AVAIL", "SCAN_COMPLETED", "CONNECTED", "CONNECT_FAILED",
+                                 "CONNECTION_LOST", "DISCONNECTED"};
+const char *resetNames[] = {"UNKNOWN", "POWERON", "EXT", "SW", "PANIC", "INT_WDT", "TASK_WDT", "WDT", "DEEPSLEEP",
+                            "BROWNOUT", "SDIO"};
+#define NAME(names, i) ((i) < sizeof(names) / sizeof(names[0]) ? names[i] : "?")
+
+/********************************************
+ * name: traceParse()
+ * parameters: path
+ * description: Every event of the dump in
+ * the capture, oldest first.
+ ********************************************/
+std::vector<TraceEvent> traceParse(const char *path){
+  std::vector<TraceEvent> events;
+  FILE *file = fopen(path, "r");
+  if(file == NULL){
+    perror(path);
+    exit(2);
+  }
+  char line[256];
+  while(fgets(line, sizeof(line), file) != NULL){
+    const char *dump = strstr(line, "[TRACE] ");
+    unsigned time, type, arg;
+    if(dump != NULL && sscanf(dump + 8, "%8x %2x %2x", &time, &type, &arg) == 3){
+      TraceEvent event;
+      event.time = time;
+      event.type = type;
+      event.arg = arg;
+      events.push_back(event);
+    }
+  }
+  fclose(file);
+  return events;
+}
+/********************************************
+ * name: traceDescribe()
+ * parameters: event
+ * description: One event as text.
+ ********************************************/
+std::string traceDescribe(const TraceEvent &event){
+  char text[96];
+  const char *detail = "";
+  char buffer[32];
+  switch(event.type){
+    case TRACE_BOOT: detail = NAME(resetNames, event.arg); break;
+    case TRACE_WIFI_EVENT: detail = NAME(wifiEventNames, event.arg); break;
+    case TRACE_WIFI_TIMEOUT: detail = NAME(wifiStatusNames, event.arg); break;
+    case TRACE_BLE_WRITE: detail = event.arg == 0 ? "network" : "password"; break;
+    case TRACE_INPUT:
+      snprintf(buffer, sizeof(buffer), "%s %s", (event.arg >> 4) < INPUT_COUNT ? inputPins[event.arg >> 4].name : "?",
+               NAME(gestureNames, event.arg & 0x0F));
+      detail = buffer;
+      break;
+  }
+  snprintf(text, sizeof(text), "%10.3f s  %-14s %s (%u)", event.time / 1000.0, NAME(traceTypeNames, event.type),
+           detail, event.arg);
+  return text;
+}
+/********************************************
+ * name: traceApply()
+ * parameters: event
+ * description: Plays one recorded input the
+ * way the radio stacks would deliver it.
+ * Events the firmware generates itself are
+ * left out.
+ ********************************************/
+void traceApply(const TraceEvent &event){
+  static esp_ble_gatts_cb_param_t param;
+  switch(event.type){
+    case TRACE_WIFI_EVENT:
+      // As the Arduino core updates WiFi.status() before the handlers run
+      if(event.arg == ARDUINO_EVENT_WIFI_STA_GOT_IP){
+        WiFi.linkStatus = WL_CONNECTED;
+      }
+      else if(event.arg == ARDUINO_EVENT_WIFI_STA_DISCONNECTED || event.arg == ARDUINO_EVENT_WIFI_STA_START){
+        WiFi.linkStatus = WL_DISCONNECTED;
+      }
+      else if(event.arg == ARDUINO_EVENT_WIFI_STA_LOST_IP){
+        WiFi.linkStatus = WL_IDLE_STATUS;
+      }
+      if(WiFi.eventHandler != NULL){
+        WiFi.eventHandler((WiFiEvent_t)event.arg);
+      }
+      break;
+    case TRACE_BLE_CONNECT:
+      hostBleServer.callbacks->onConnect(&hostBleServer, &param);
+      break;
+    case TRACE_BLE_DISCONNECT:
+      hostBleServer.callbacks->onDisconnect(&hostBleServer);
+      break;
+    case TRACE_BLE_WRITE:
+      // The trace has no values; the current one keeps the settings as they were
+      if(event.arg == 0){
+        hostBleServer.service.hostFind(NETWORK_UUID)->hostWrite(WIFI_NETWORK);
+      }
+      else{
+        hostBleServer.service.hostFind(PASSWORD_UUID)->hostWrite(WIFI_PASSWORD);
+      }
+      break;
+    case TRACE_INPUT:
+      if((event.arg >> 4) < INPUT_COUNT){
+        inputGesture(event.arg >> 4, event.arg & 0x0F, micros());
+      }
+      break;
+  }
+}
+
+int main(int argc, char **argv){
+  bool decodeOnly = false;
+  bool verbose = false;
+  int boot = -1;
+  int opt;
+  while((opt = getopt(argc, argv, "dvb:")) != -1){
+    if(opt == 'd'){
+      decodeOnly = true;
+    }
+    else if(opt == 'v'){
+      verbose = true;
+    }
+    else if(opt == 'b'){
+      boot = atoi(optarg);
+    }
+    else{
+      fprintf(stderr, "usage: %s [-d] [-v] [-b boot] trace.txt\n", argv[0]);
+      return 2;
+    }
+  }
+  if(optind != argc - 1){
+    fprintf(stderr, "usage: %s [-d] [-v] [-b boot] trace.txt\n", argv[0]);
+    return 2;
+  }
+  std::vector<TraceEvent> events = traceParse(argv[optind]);
+  // Split into boots; events before the first TRACE_BOOT lost theirs to the ring
+  std::vector<std::vector<TraceEvent>> boots;
+  for(const TraceEvent &event : events){
+    if(event.type == TRACE_BOOT || boots.empty()){
+      boots.emplace_back();
+    }
+    boots.back().push_back(event);
+  }
+  if(decodeOnly){
+    for(size_t i=0;i<boots.size();i++){
+      printf("boot %u%s\n", (unsigned)i, boots[i][0].type == TRACE_BOOT ? "" : " (start lost)");
+      for(const TraceEvent &event : boots[i]){
+        printf("  %s\n", traceDescribe(event).c_str());
+      }
+    }
+    return 0;
+  }
+  if(boots.empty()){
+    fprintf(stderr, "%s: no trace events\n", argv[optind]);
+    return 2;
+  }
+  if(boot < 0){
+    boot = boots.size() - 1;
+  }
+  if(boot >= (int)boots.size()){
+    fprintf(stderr, "only %u boots\n", (unsigned)boots.size());
+    return 2;
+  }
+  const std::vector<TraceEvent> &segment = boots[boot];
+  std::vector<uint32_t> recorded;
+  for(const TraceEvent &event : segment){
+    if(event.type == TRACE_WIFI_TIMEOUT){
+      recorded.push_back(event.time);
+    }
+  }
+
+  auto wallStart = std::chrono::steady_clock::now();
+  setup();
+  WiFi.linkStatus = WL_DISCONNECTED;
+  std::vector<uint32_t> replayed;
+  uint32_t seen = traceHead;
+  size_t next = 0;
+  bool applying = false;
+  bool restarted = false;
+  uint32_t end = segment.back().time + 1000;
+  hostTick = [&]() -> bool {
+    if(applying){
+      return false;
+    }
+    applying = true;
+    bool acted = false;
+    while(next < segment.size() && millis() >= segment[next].time){
+      if(verbose){
+        printf("  %s\n", traceDescribe(segment[next]).c_str());
+      }
+      traceApply(segment[next++]);
+      acted = true;
+    }
+    // What the bleStatus task does when a timer notifies it
+    if(blePending != 0){
+      blePendingRun();
+    }
+    for(;seen != traceHead;seen++){
+      const TraceEvent &event = traceRing[seen % TRACE_EVENTS];
+      if(event.type == TRACE_WIFI_TIMEOUT){
+        replayed.push_back(event.time);
+        if(verbose){
+          printf("  %s  <- replayed\n", traceDescribe(event).c_str());
+        }
+      }
+    }
+    applying = false;
+    if(millis() >= end){
+      throw HostStop();
+    }
+    return acted;
+  };
+  try{
+    keepWiFiAlive(NULL);
+  }
+  catch(HostStop &){
+  }
+  catch(HostRestart &){
+    restarted = true;
+  }
+  hostTick = nullptr;
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+  if(verbose){
+    printf("firmware log:\n%s", Serial.output.c_str());
+  }
+  printf("boot %d: %u events over %.1f s, %s\n", boot, (unsigned)segment.size(), segment.back().time / 1000.0,
+         segment[0].type == TRACE_BOOT ? NAME(resetNames, segment[0].arg) : "start lost");
+  printf("replayed in %.3f s, %.0fx real time%s\n", wall, millis() / 1000.0 / wall, restarted ? ", ended in a restart" : "");
+  uint32_t skew = 0;
+  for(size_t i=0;i<min(recorded.size(), replayed.size());i++){
+    skew = max(skew, (uint32_t)abs((int32_t)(replayed[i] - recorded[i])));
+  }
+  printf("WiFi timeouts: %u recorded, %u replayed, largest skew %u ms\n", (unsigned)recorded.size(),
+         (unsigned)replayed.size(), (unsigned)skew);
+  printf("WiFi.begin() calls: %d\n", WiFi.begins);
+  return recorded.size() != replayed.size();
+}
@@ -0,0 +1,319 @@
+/***********************************************
+ * Host stand-in for the Arduino-ESP32 core and
+ * FreeRTOS, just enough to run main.cpp on a
+ * PC. Single threaded: tasks are not started,
+ * a test calls the functions it wants, and
+ * every blocking wait advances a virtual clock
+ * in 1 ms steps instead of sleeping.
+ */
+#pragma once
+#include <algorithm>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctype.h>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+using std::min;
+using std::max;
+
+// Harness control
+struct HostStop {};               // Thrown to end an endless task loop
+struct HostRestart {};            // Thrown by ESP.restart()
+inline uint64_t hostMicros = 0;   // Virtual clock
+// Called after every virtual millisecond spent waiting; returns true
+// when it made something ready, which ends an interruptible wait
+inline std::function<bool()> hostTick;
+inline uint32_t hostRandom = 0x12345678;
+
+// Types and macros
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void *QueueHandle_t;
+typedef void *TaskHandle_t;
+typedef void *SemaphoreHandle_t;
+typedef void *TimerHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t);
+typedef int portMUX_TYPE;
+typedef int esp_err_t;
+#define ESP_OK              0
+#define ESP_FAIL            -1
+#define pdTRUE              1
+#define pdFALSE             0
+#define pdPASS              1
+#define portTICK_PERIOD_MS  1
+#define portMAX_DELAY       0xFFFFFFFF
+#define pdMS_TO_TICKS(x)    (x)
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(x) (void)(x)
+#define portEXIT_CRITICAL(x)  (void)(x)
+#define portYIELD_FROM_ISR(x) (void)(x)
+#define IRAM_ATTR
+#define RTC_NOINIT_ATTR
+#define RTC_DATA_ATTR
+#define INPUT_PULLUP        0x05
+#define CHANGE              0x03
+#define SERIAL_8N1          0x800001c
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+// Time
+inline unsigned long millis(){ return hostMicros / 1000; }
+inline unsigned long micros(){ return hostMicros; }
+struct HostTimer {
+  TickType_t period;
+  TimerCallbackFunction_t callback;
+  bool active;
+  uint64_t expiry;
+};
+inline std::vector<HostTimer *> hostTimers;
+// Runs expired timers, as the FreeRTOS timer task would
+inline void hostRunTimers(){
+  for(HostTimer *timer : hostTimers){
+    if(timer->active && hostMicros >= timer->expiry){
+      timer->active = false;
+      timer->callback(timer);
+    }
+  }
+}
+/********************************************
+ * name: hostWait()
+ * parameters: ticks, interruptible
+ * description: Spends ticks of virtual time.
+ * An interruptible wait ends early once the
+ * tick hook reports something ready.
+ ********************************************/
+inline void hostWait(TickType_t ticks, bool interruptible){
+  for(TickType_t i=0;ticks == portMAX_DELAY || i<ticks;i++){
+    hostMicros += 1000;
+    hostRunTimers();
+    if(hostTick && hostTick() && interruptible){
+      return;
+    }
+  }
+}
+inline void delay(unsigned long ms){ hostWait(ms, false); }
+inline void vTaskDelay(TickType_t ticks){ hostWait(ticks, false); }
+inline void vTaskDelayUntil(TickType_t *lastWake, TickType_t period){
+  TickType_t now = millis();
+  if((int32_t)(*lastWake + period - now) > 0){
+    hostWait(*lastWake + period - now, false);
+  }
+  *lastWake += period;
+}
+inline TickType_t xTaskGetTickCount(){ return millis(); }
+
+// Tasks: created but never run
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t, const char *, uint32_t, void *, UBaseType_t, TaskHandle_t *handle, BaseType_t){
+  static int tasks[32];
+  static int count = 0;
+  if(handle != NULL){
+    *handle = &tasks[count++ % 32];
+  }
+  return pdPASS;
+}
+inline void vTaskDelete(TaskHandle_t){ throw HostStop(); }
+inline uint32_t hostNotified = 0; // One notification count for all tasks
+inline BaseType_t xTaskNotifyGive(TaskHandle_t){ hostNotified++; return pdPASS; }
+inline uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks){
+  if(hostNotified == 0 && ticks > 0){
+    hostWait(ticks, true);
+  }
+  uint32_t count = hostNotified;
+  hostNotified = clear || count == 0 ? 0 : count - 1;
+  return count;
+}
+inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t){ return 0; }
+inline char *pcTaskGetName(TaskHandle_t){ static char name[] = "task"; return name; }
+inline UBaseType_t uxTaskGetNumberOfTasks(){ return 0; }
+
+// Queues
+struct HostQueue {
+  size_t length;
+  size_t itemSize;
+  std::deque<std::vector<uint8_t>> items;
+};
+inline QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize){
+  return new HostQueue{length, itemSize, {}};
+}
+inline BaseType_t xQueueSend(QueueHandle_t handle, const void *item, TickType_t){
+  HostQueue *queue = (HostQueue *)handle;
+  if(queue->items.size() >= queue->length){
+    return pdFALSE;
+  }
+  queue->items.emplace_back((const uint8_t *)item, (const uint8_t *)item + queue->itemSize);
+  return pdTRUE;
+}
+inline BaseType_t xQueueSendFromISR(QueueHandle_t handle, const void *item, BaseType_t *){
+  return xQueueSend(handle, item, 0);
+}
+inline BaseType_t xQueuePeek(QueueHandle_t handle, void *item, TickType_t ticks){
+  HostQueue *queue = (HostQueue *)handle;
+  if(queue->items.empty() && ticks > 0){
+    hostWait(ticks, true);
+  }
+  if(queue->items.empty()){
+    return pdFALSE;
+  }
+  memcpy(item, queue->items.front().data(), queue->itemSize);
+  return pdTRUE;
+}
+inline BaseType_t xQueueReceive(QueueHandle_t handle, void *item, TickType_t ticks){
+  if(xQueuePeek(handle, item, ticks) != pdTRUE){
+    return pdFALSE;
+  }
+  ((HostQueue *)handle)->items.pop_front();
+  return pdTRUE;
+}
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t handle){
+  return ((HostQueue *)handle)->items.size();
+}
+
+// Semaphores: nothing runs concurrently, so they always succeed
+inline SemaphoreHandle_t hostSemaphore(){ static int semaphore; return &semaphore; }
+inline SemaphoreHandle_t xSemaphoreCreateMutex(){ return hostSemaphore(); }
+inline SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(){ return hostSemaphore(); }
+inline SemaphoreHandle_t xSemaphoreCreateBinary(){ return hostSemaphore(); }
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t){ return pdTRUE; }
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t){ return pdTRUE; }
+inline BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t, TickType_t){ return pdTRUE; }
+inline BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t){ return pdTRUE; }
+
+// Software timers
+inline TimerHandle_t xTimerCreate(const char *, TickType_t period, UBaseType_t, void *, TimerCallbackFunction_t callback){
+  HostTimer *timer = new HostTimer{period, callback, false, 0};
+  hostTimers.push_back(timer);
+  return timer;
+}
+inline BaseType_t xTimerReset(TimerHandle_t handle, TickType_t){
+  if(handle != NULL){
+    ((HostTimer *)handle)->active = true;
+    ((HostTimer *)handle)->expiry = hostMicros + ((HostTimer *)handle)->period * 1000ULL;
+  }
+  return pdPASS;
+}
+inline BaseType_t xTimerStop(TimerHandle_t handle, TickType_t){
+  if(handle != NULL){
+    ((HostTimer *)handle)->active = false;
+  }
+  return pdPASS;
+}
+
+// Strings and addresses
+class String {
+  public:
+    String(){}
+    String(const char *text): text(text != NULL ? text : "") {}
+    String(const std::string &text): text(text) {}
+    const char *c_str() const { return text.c_str(); }
+    unsigned length() const { return text.length(); }
+    bool operator==(const String &other) const { return text == other.text; }
+    String operator+(const String &other) const { return String(text + other.text); }
+  private:
+    std::string text;
+};
+class IPAddress {
+  public:
+    IPAddress(){}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d): bytes{a, b, c, d} {}
+    String toString() const {
+      char text[16];
+      snprintf(text, sizeof(text), "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]);
+      return String(text);
+    }
+  private:
+    uint8_t bytes[4] = {0, 0, 0, 0};
+};
+
+// Streams
+class Print {
+  public:
+    virtual ~Print(){}
+    virtual size_t write(uint8_t c){ return write(&c, 1); }
+    virtual size_t write(const uint8_t *, size_t length){ return length; }
+    size_t print(const char *text){ return write((const uint8_t *)text, strlen(text)); }
+    size_t println(char c){ return write((uint8_t)c) + print("\r\n"); }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3))){
+      char text[512];
+      va_list args;
+      va_start(args, format);
+      int length = vsnprintf(text, sizeof(text), format, args);
+      va_end(args);
+      return write((const uint8_t *)text, constrain(length, 0, (int)sizeof(text) - 1));
+    }
+};
+class Stream: public Print {
+  public:
+    virtual int available(){ return 0; }
+    virtual int read(){ return -1; }
+    void setTimeout(unsigned long){}
+    size_t readBytes(uint8_t *buffer, size_t length){
+      size_t count = 0;
+      while(count < length && available() > 0){
+        buffer[count++] = read();
+      }
+      return count;
+    }
+};
+/********************************************
+ * class name: HardwareSerial
+ * description: UART that collects what the
+ * firmware writes in output and hands out
+ * what a test put in input.
+ ********************************************/
+class HardwareSerial: public Stream {
+  public:
+    std::string output;
+    std::string input;
+    using Print::write;
+    size_t write(const uint8_t *data, size_t length){
+      output.append((const char *)data, length);
+      return length;
+    }
+    int available(){ return input.size(); }
+    int read(){
+      if(input.empty()){
+        return -1;
+      }
+      int c = (uint8_t)input[0];
+      input.erase(0, 1);
+      return c;
+    }
+    void begin(unsigned long, uint32_t = SERIAL_8N1, int = -1, int = -1){}
+    size_t setRxBufferSize(size_t size){ return size; }
+    void onReceive(std::function<void(void)> callback){ receive = callback; }
+    std::function<void(void)> receive;
+};
+inline HardwareSerial Serial;
+inline HardwareSerial Serial1;
+
+// Chip
+struct EspClass {
+  uint32_t freeHeap = 150000;
+  uint32_t getFreeHeap(){ return freeHeap; }
+  uint32_t getMinFreeHeap(){ return freeHeap; }
+  uint32_t getMaxAllocHeap(){ return freeHeap; }
+  uint64_t getEfuseMac(){ return 0x0000A1B2C3D4E5F6ULL; }
+  void restart(){ throw HostRestart(); }
+};
+inline EspClass ESP;
+inline uint32_t esp_random(){
+  // xorshift32, so every run is the same
+  hostRandom ^= hostRandom << 13;
+  hostRandom ^= hostRandom >> 17;
+  hostRandom ^= hostRandom << 5;
+  return hostRandom;
+}
+inline int esp_reset_reason(){ return 1; }
+inline uint32_t hostCpuMhz = 240;
+inline bool setCpuFrequencyMhz(uint32_t mhz){ hostCpuMhz = mhz; return true; }
+inline uint32_t getCpuFrequencyMhz(){ return hostCpuMhz; }
+
+// GPIO
+inline void pinMode(uint8_t, uint8_t){}
+inline void attachInterruptArg(uint8_t, void (*)(void *), void *, int){}
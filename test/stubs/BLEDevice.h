@@ -0,0 +1,129 @@
+// Host stand-in for the Arduino-ESP32 BLE library. Objects keep the
+// callbacks the firmware registers, so a test can play the central
+#pragma once
+#include "Arduino.h"
+typedef uint8_t esp_bd_addr_t[6];
+struct esp_ble_gatts_cb_param_t {
+  struct {
+    uint16_t conn_id;
+    esp_bd_addr_t remote_bda;
+  } connect;
+};
+class BLEServer;
+class BLECharacteristic;
+class BLEServerCallbacks {
+  public:
+    virtual ~BLEServerCallbacks(){}
+    virtual void onConnect(BLEServer *, esp_ble_gatts_cb_param_t *){}
+    virtual void onDisconnect(BLEServer *){}
+};
+class BLECharacteristicCallbacks {
+  public:
+    virtual ~BLECharacteristicCallbacks(){}
+    virtual void onWrite(BLECharacteristic *){}
+};
+class BLEDescriptor {};
+class BLE2902: public BLEDescriptor {};
+inline std::vector<std::string> hostBleNotified; // Every notification sent
+class BLECharacteristic {
+  public:
+    static const uint32_t PROPERTY_READ = 1, PROPERTY_WRITE = 2, PROPERTY_NOTIFY = 4, PROPERTY_WRITE_NR = 8;
+    std::string uuid;
+    std::string value;
+    BLECharacteristicCallbacks *callbacks = NULL;
+    std::string getValue(){ return value; }
+    void setValue(const char *text){ value = text; }
+    void setCallbacks(BLECharacteristicCallbacks *c){ callbacks = c; }
+    void addDescriptor(BLEDescriptor *){}
+    void notify(){ hostBleNotified.push_back(value); }
+    // Plays a central writing the characteristic
+    void hostWrite(const std::string &data){
+      value = data;
+      if(callbacks != NULL){
+        callbacks->onWrite(this);
+      }
+    }
+};
+class BLEService {
+  public:
+    std::vector<BLECharacteristic *> characteristics;
+    BLECharacteristic *createCharacteristic(const char *uuid, uint32_t){
+      BLECharacteristic *characteristic = new BLECharacteristic();
+      characteristic->uuid = uuid;
+      characteristics.push_back(characteristic);
+      return characteristic;
+    }
+    BLECharacteristic *hostFind(const char *uuid){
+      for(BLECharacteristic *characteristic : characteristics){
+        if(characteristic->uuid == uuid){
+          return characteristic;
+        }
+      }
+      return NULL;
+    }
+    void start(){}
+};
+class BLEAdvertising {
+  public:
+    bool running = false;
+    int restarts = 0;
+    uint16_t minInterval = 0;
+    void start(){ running = true; restarts++; }
+    void stop(){ running = false; }
+    void addServiceUUID(const char *){}
+    void setScanResponse(bool){}
+    void setMinPreferred(uint16_t){}
+    void setMinInterval(uint16_t interval){ minInterval = interval; }
+    void setMaxInterval(uint16_t){}
+};
+inline BLEAdvertising hostAdvertising;
+class BLEServer {
+  public:
+    BLEServerCallbacks *callbacks = NULL;
+    BLEService service;
+    uint16_t minInterval = 0;     // Last connection parameter update
+    void setCallbacks(BLEServerCallbacks *c){ callbacks = c; }
+    BLEService *createService(const char *){ return &service; }
+    BLEAdvertising *getAdvertising(){ return &hostAdvertising; }
+    void updateConnParams(esp_bd_addr_t, uint16_t min, uint16_t, uint16_t, uint16_t){ minInterval = min; }
+};
+inline BLEServer hostBleServer;
+class BLEAddress {
+  public:
+    std::string toString(){ return "00:00:00:00:00:00"; }
+    esp_bd_addr_t *getNative(){ return &address; }
+  private:
+    esp_bd_addr_t address = {0};
+};
+class BLEAdvertisedDevice {
+  public:
+    BLEAddress getAddress(){ return BLEAddress(); }
+    int getRSSI(){ return -70; }
+    uint8_t *getPayload(){ static uint8_t payload[31]; return payload; }
+    size_t getPayloadLength(){ return 0; }
+};
+class BLEAdvertisedDeviceCallbacks {
+  public:
+    virtual ~BLEAdvertisedDeviceCallbacks(){}
+    virtual void onResult(BLEAdvertisedDevice) = 0;
+};
+class BLEScan {
+  public:
+    void setAdvertisedDeviceCallbacks(BLEAdvertisedDeviceCallbacks *, bool = false){}
+    void setActiveScan(bool){}
+    void setInterval(uint16_t){}
+    void setWindow(uint16_t){}
+    bool start(uint32_t, void (*)(int), bool = false){ return true; }
+    void stop(){}
+    void clearResults(){}
+};
+class BLEDevice {
+  public:
+    static void init(const char *){}
+    static int setMTU(uint16_t){ return 0; }
+    static uint16_t getMTU(){ return 23; }
+    static BLEServer *createServer(){ return &hostBleServer; }
+    static BLEAdvertising *getAdvertising(){ return &hostAdvertising; }
+    static void startAdvertising(){ hostAdvertising.start(); }
+    static BLEScan *getScan(){ static BLEScan scan; return &scan; }
+};
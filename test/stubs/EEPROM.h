@@ -0,0 +1,17 @@
+// Host stand-in for the EEPROM library: a RAM array, and commit()
+// succeeds unless a test sets hostEepromFail
+#pragma once
+#include "Arduino.h"
+inline bool hostEepromFail = false;
+class EEPROMClass {
+  public:
+    uint8_t data[4096];
+    int commits = 0;
+    bool begin(size_t){ return true; }
+    uint8_t read(int address){ return data[address]; }
+    void write(int address, uint8_t value){ data[address] = value; }
+    bool commit(){ commits++; return !hostEepromFail; }
+    template<class T> T &get(int address, T &value){ memcpy(&value, data + address, sizeof(T)); return value; }
+    template<class T> const T &put(int address, const T &value){ memcpy(data + address, &value, sizeof(T)); return value; }
+};
+inline EEPROMClass EEPROM;
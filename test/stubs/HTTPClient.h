@@ -0,0 +1,18 @@
+// Host stand-in for HTTPClient: every request gets hostHttpCode
+#pragma once
+#include "WiFi.h"
+inline int hostHttpCode = -1;     // Negative = connection failed
+inline std::string hostHttpBody;
+class HTTPClient {
+  public:
+    bool begin(const char *){ return true; }
+    void end(){}
+    void setReuse(bool){}
+    void addHeader(const String &, const String &){}
+    void collectHeaders(const char *[], size_t){}
+    int GET(){ return hostHttpCode; }
+    int POST(uint8_t *, size_t){ return hostHttpCode; }
+    int PATCH(uint8_t *, size_t){ return hostHttpCode; }
+    String getString(){ return String(hostHttpBody); }
+    String header(const char *){ return String(); }
+};
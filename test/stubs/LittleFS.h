@@ -0,0 +1,26 @@
+// Host stand-in for LittleFS: there is no partition, so it never mounts
+#pragma once
+#include "Arduino.h"
+class File {
+  public:
+    size_t write(const uint8_t *, size_t length){ return length; }
+    size_t read(uint8_t *, size_t){ return 0; }
+    size_t size(){ return 0; }
+    void flush(){}
+    void close(){}
+    const char *name(){ return ""; }
+    File openNextFile(){ return File(); }
+    operator bool() const { return false; }
+};
+class LittleFSFS {
+  public:
+    bool begin(bool = false, const char * = "/littlefs", uint8_t = 10, const char * = "spiffs"){ return false; }
+    File open(const char *, const char * = "r"){ return File(); }
+    bool exists(const char *){ return false; }
+    bool remove(const char *){ return false; }
+    bool rename(const char *, const char *){ return false; }
+    bool mkdir(const char *){ return false; }
+    size_t totalBytes(){ return 0; }
+    size_t usedBytes(){ return 0; }
+};
+inline LittleFSFS LittleFS;
@@ -0,0 +1,20 @@
+// Host stand-in for WebServer, never serves anything
+#pragma once
+#include "WiFi.h"
+class WebServer {
+  public:
+    WebServer(int){}
+    void begin(){}
+    void handleClient(){}
+    void collectHeaders(const char *[], size_t){}
+    void onNotFound(void (*)()){}
+    String uri(){ return String("/"); }
+    bool hasHeader(const char *){ return false; }
+    String header(const char *){ return String(); }
+    void sendHeader(const char *, const char *){}
+    void setContentLength(size_t){}
+    void send(int, const char * = NULL, const char * = NULL){}
+    WiFiClient &client(){ return connection; }
+  private:
+    WiFiClient connection;
+};
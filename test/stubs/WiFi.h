@@ -0,0 +1,100 @@
+// Host stand-in for the WiFi library: the link state is whatever the
+// test sets, and UDP datagrams are collected instead of sent
+#pragma once
+#include "Arduino.h"
+typedef enum { WL_IDLE_STATUS = 0, WL_NO_SSID_AVAIL, WL_SCAN_COMPLETED, WL_CONNECTED, WL_CONNECT_FAILED,
+               WL_CONNECTION_LOST, WL_DISCONNECTED } wl_status_t;
+typedef enum { WIFI_OFF = 0, WIFI_STA, WIFI_AP, WIFI_AP_STA } wifi_mode_t;
+typedef enum { WIFI_IF_STA = 0, WIFI_IF_AP } wifi_interface_t;
+typedef enum { WIFI_AUTH_OPEN = 0, WIFI_AUTH_WEP, WIFI_AUTH_WPA_PSK, WIFI_AUTH_WPA2_PSK, WIFI_AUTH_WPA_WPA2_PSK,
+               WIFI_AUTH_WPA2_ENTERPRISE, WIFI_AUTH_WPA3_PSK, WIFI_AUTH_WPA2_WPA3_PSK } wifi_auth_mode_t;
+typedef enum { WIFI_POWER_19_5dBm = 78, WIFI_POWER_17dBm = 68, WIFI_POWER_15dBm = 60, WIFI_POWER_13dBm = 52,
+               WIFI_POWER_11dBm = 44, WIFI_POWER_8_5dBm = 34, WIFI_POWER_7dBm = 28, WIFI_POWER_5dBm = 20,
+               WIFI_POWER_2dBm = 8 } wifi_power_t;
+// Arduino-ESP32 2.x event numbers, as they appear in the trace
+typedef enum {
+  ARDUINO_EVENT_WIFI_READY = 0, ARDUINO_EVENT_WIFI_SCAN_DONE, ARDUINO_EVENT_WIFI_STA_START,
+  ARDUINO_EVENT_WIFI_STA_STOP, ARDUINO_EVENT_WIFI_STA_CONNECTED, ARDUINO_EVENT_WIFI_STA_DISCONNECTED,
+  ARDUINO_EVENT_WIFI_STA_AUTHMODE_CHANGE, ARDUINO_EVENT_WIFI_STA_GOT_IP, ARDUINO_EVENT_WIFI_STA_GOT_IP6,
+  ARDUINO_EVENT_WIFI_STA_LOST_IP, ARDUINO_EVENT_WIFI_AP_START, ARDUINO_EVENT_WIFI_AP_STOP,
+  ARDUINO_EVENT_MAX = 64
+} arduino_event_id_t;
+typedef arduino_event_id_t WiFiEvent_t;
+struct HostNetwork {
+  std::string ssid;
+  int rssi;
+  wifi_auth_mode_t mode;
+};
+class WiFiClass {
+  public:
+    wl_status_t linkStatus = WL_DISCONNECTED;
+    int8_t rssi = -60;
+    wifi_mode_t wifiMode = WIFI_OFF;
+    std::string ssid;             // Last WiFi.begin()
+    std::string passphrase;
+    int begins = 0;
+    std::vector<HostNetwork> networks; // What a scan finds
+    void (*eventHandler)(WiFiEvent_t) = NULL;
+    wl_status_t status(){ return linkStatus; }
+    bool mode(wifi_mode_t m){ wifiMode = m; return true; }
+    wifi_mode_t getMode(){ return wifiMode; }
+    wl_status_t begin(const char *s, const char *p = NULL){
+      ssid = s;
+      passphrase = p != NULL ? p : "";
+      begins++;
+      return linkStatus;
+    }
+    bool disconnect(bool = false){ linkStatus = WL_DISCONNECTED; return true; }
+    IPAddress localIP(){ return IPAddress(192, 168, 1, 2); }
+    IPAddress gatewayIP(){ return IPAddress(192, 168, 1, 1); }
+    int8_t RSSI(){ return rssi; }
+    int32_t RSSI(uint8_t i){ return networks[i].rssi; }
+    String SSID(uint8_t i){ return String(networks[i].ssid); }
+    wifi_auth_mode_t encryptionType(uint8_t i){ return networks[i].mode; }
+    int32_t channel(){ return 1; }
+    int16_t scanNetworks(bool = false, bool = false, bool = false, uint32_t = 300, uint8_t = 0, const char * = NULL){
+      return networks.size();
+    }
+    void scanDelete(){}
+    bool setTxPower(wifi_power_t){ return true; }
+    bool softAP(const char *, const char * = NULL){ return true; }
+    bool softAPConfig(IPAddress, IPAddress, IPAddress){ return true; }
+    bool softAPdisconnect(bool = false){ return true; }
+    int onEvent(void (*handler)(WiFiEvent_t)){ eventHandler = handler; return 0; }
+};
+inline WiFiClass WiFi;
+class WiFiClient: public Stream {
+  public:
+    int connect(const char *, uint16_t){ return 0; }
+    uint8_t connected(){ return 0; }
+    void stop(){}
+    int fd() const { return -1; }
+    void setNoDelay(bool){}
+    using Stream::read;
+    int read(uint8_t *, size_t){ return -1; }
+    explicit operator bool(){ return false; }
+};
+class WiFiServer {
+  public:
+    WiFiServer(uint16_t){}
+    void begin(){}
+    void end(){}
+    WiFiClient available(){ return WiFiClient(); }
+};
+inline std::vector<std::string> hostDatagrams; // Every UDP datagram sent
+class WiFiUDP: public Stream {
+  public:
+    uint8_t begin(uint16_t){ return 1; }
+    int beginPacket(const char *, uint16_t){ packet.clear(); return 1; }
+    int beginPacket(IPAddress, uint16_t){ packet.clear(); return 1; }
+    using Print::write;
+    size_t write(const uint8_t *data, size_t length){ packet.append((const char *)data, length); return length; }
+    int endPacket(){ hostDatagrams.push_back(packet); return 1; }
+    int parsePacket(){ return 0; }
+    using Stream::read;
+    int read(uint8_t *, size_t){ return 0; }
+    void flush(){}
+    IPAddress remoteIP(){ return IPAddress(); }
+  private:
+    std::string packet;
+};
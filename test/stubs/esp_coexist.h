@@ -0,0 +1,4 @@
+#pragma once
+#include "Arduino.h"
+typedef enum { ESP_COEX_PREFER_WIFI = 0, ESP_COEX_PREFER_BT, ESP_COEX_PREFER_BALANCE } esp_coex_prefer_t;
+inline esp_err_t esp_coex_preference_set(esp_coex_prefer_t){ return ESP_OK; }
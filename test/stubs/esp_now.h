@@ -0,0 +1,15 @@
+#pragma once
+#include "WiFi.h"
+#define ESP_NOW_MAX_DATA_LEN 250
+typedef enum { ESP_NOW_SEND_SUCCESS = 0, ESP_NOW_SEND_FAIL } esp_now_send_status_t;
+typedef struct {
+  uint8_t peer_addr[6];
+  uint8_t channel;
+  wifi_interface_t ifidx;
+  bool encrypt;
+} esp_now_peer_info_t;
+inline esp_err_t esp_now_init(){ return ESP_FAIL; }
+inline esp_err_t esp_now_register_send_cb(void (*)(const uint8_t *, esp_now_send_status_t)){ return ESP_OK; }
+inline esp_err_t esp_now_register_recv_cb(void (*)(const uint8_t *, const uint8_t *, int)){ return ESP_OK; }
+inline esp_err_t esp_now_add_peer(const esp_now_peer_info_t *){ return ESP_OK; }
+inline esp_err_t esp_now_send(const uint8_t *, const uint8_t *, size_t){ return ESP_FAIL; }
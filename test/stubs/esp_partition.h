@@ -0,0 +1,10 @@
+#pragma once
+#include "Arduino.h"
+typedef struct { uint32_t size; } esp_partition_t;
+typedef uint32_t spi_flash_mmap_handle_t;
+typedef enum { SPI_FLASH_MMAP_DATA } spi_flash_mmap_memory_t;
+typedef enum { ESP_PARTITION_TYPE_DATA = 1 } esp_partition_type_t;
+typedef enum { ESP_PARTITION_SUBTYPE_ANY = 0xFF } esp_partition_subtype_t;
+inline const esp_partition_t *esp_partition_find_first(esp_partition_type_t, esp_partition_subtype_t, const char *){ return NULL; }
+inline esp_err_t esp_partition_mmap(const esp_partition_t *, size_t, size_t, spi_flash_mmap_memory_t, const void **, spi_flash_mmap_handle_t *){ return ESP_FAIL; }
+inline void spi_flash_munmap(spi_flash_mmap_handle_t){}
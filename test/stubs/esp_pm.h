@@ -0,0 +1,6 @@
+// No CONFIG_PM_ENABLE on the host, like a core built without esp_pm
+#pragma once
+#include "Arduino.h"
+typedef void *esp_pm_lock_handle_t;
+inline esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t){ return ESP_OK; }
+inline esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t){ return ESP_OK; }
@@ -0,0 +1,17 @@
+#pragma once
+#include "WiFi.h"
+#define WIFI_MODE_APSTA WIFI_AP_STA
+typedef struct {
+  uint8_t ssid[32];
+  uint8_t password[64];
+  uint8_t ssid_len;
+  wifi_auth_mode_t authmode;
+  uint8_t ssid_hidden;
+  uint8_t max_connection;
+  uint16_t beacon_interval;
+} wifi_ap_config_t;
+typedef union { wifi_ap_config_t ap; } wifi_config_t;
+inline esp_err_t esp_wifi_stop(){ return ESP_OK; }
+inline esp_err_t esp_wifi_start(){ return ESP_OK; }
+inline esp_err_t esp_wifi_set_mode(wifi_mode_t){ return ESP_OK; }
+inline esp_err_t esp_wifi_set_config(wifi_interface_t, wifi_config_t *){ return ESP_OK; }
@@ -0,0 +1,6 @@
+#pragma once
+#include "../Arduino.h"
+typedef int gpio_num_t;
+typedef struct { uint32_t in; } gpio_dev_t;
+inline gpio_dev_t GPIO;
+inline int gpio_ll_get_level(gpio_dev_t *, gpio_num_t){ return 1; }
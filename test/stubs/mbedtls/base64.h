@@ -0,0 +1,3 @@
+#pragma once
+#include "../Arduino.h"
+inline int mbedtls_base64_encode(unsigned char *, size_t, size_t *length, const unsigned char *, size_t){ *length = 0; return 0; }
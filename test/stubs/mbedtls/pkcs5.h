@@ -0,0 +1,19 @@
+#pragma once
+#include "md.h"
+// Not PBKDF2: a cheap stand-in that still depends on every input byte
+inline int mbedtls_pkcs5_pbkdf2_hmac(mbedtls_md_context_t *, const unsigned char *password, size_t passwordLength,
+                                     const unsigned char *salt, size_t saltLength, unsigned int, uint32_t keyLength,
+                                     unsigned char *key){
+  uint32_t hash = 2166136261;
+  for(size_t i=0;i<passwordLength;i++){
+    hash = (hash ^ password[i]) * 16777619;
+  }
+  for(size_t i=0;i<saltLength;i++){
+    hash = (hash ^ salt[i]) * 16777619;
+  }
+  for(uint32_t i=0;i<keyLength;i++){
+    hash = (hash ^ i) * 16777619;
+    key[i] = hash >> 24;
+  }
+  return 0;
+}
@@ -0,0 +1,3 @@
+#pragma once
+#include "../Arduino.h"
+inline int mbedtls_sha1(const unsigned char *, size_t, unsigned char output[20]){ memset(output, 0, 20); return 0; }
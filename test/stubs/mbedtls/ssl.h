@@ -0,0 +1,59 @@
+// Host stand-in for mbedTLS. Nothing is encrypted; init calls count
+// live contexts so a test can check that every one is freed again
+#pragma once
+#include "../Arduino.h"
+typedef struct { int x; } mbedtls_ssl_context;
+typedef struct { int x; } mbedtls_ssl_config;
+typedef struct { int x; } mbedtls_ctr_drbg_context;
+typedef struct { int x; } mbedtls_entropy_context;
+typedef struct { int x; } mbedtls_x509_crt;
+typedef struct { size_t id_len; unsigned char id[32]; } mbedtls_ssl_session;
+#define MBEDTLS_ERR_SSL_WANT_READ   -0x6900
+#define MBEDTLS_ERR_SSL_WANT_WRITE  -0x6880
+#define MBEDTLS_ERR_NET_CONN_RESET  -0x0050
+#define MBEDTLS_SSL_IS_CLIENT       0
+#define MBEDTLS_SSL_TRANSPORT_STREAM 0
+#define MBEDTLS_SSL_PRESET_DEFAULT  0
+#define MBEDTLS_SSL_VERIFY_REQUIRED 2
+#define MBEDTLS_SSL_SESSION_TICKETS_ENABLED 1
+#define MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256 0xC02B
+#define MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256   0xC02F
+inline int hostTlsLive = 0;       // Contexts initialised and not freed
+inline int hostTlsSeedResult = 0; // What mbedtls_ctr_drbg_seed() returns
+inline void mbedtls_ssl_init(mbedtls_ssl_context *){ hostTlsLive++; }
+inline void mbedtls_ssl_config_init(mbedtls_ssl_config *){ hostTlsLive++; }
+inline void mbedtls_ctr_drbg_init(mbedtls_ctr_drbg_context *){ hostTlsLive++; }
+inline void mbedtls_entropy_init(mbedtls_entropy_context *){ hostTlsLive++; }
+inline void mbedtls_x509_crt_init(mbedtls_x509_crt *){ hostTlsLive++; }
+inline void mbedtls_ssl_free(mbedtls_ssl_context *){ hostTlsLive--; }
+inline void mbedtls_ssl_config_free(mbedtls_ssl_config *){ hostTlsLive--; }
+inline void mbedtls_ctr_drbg_free(mbedtls_ctr_drbg_context *){ hostTlsLive--; }
+inline void mbedtls_entropy_free(mbedtls_entropy_context *){ hostTlsLive--; }
+inline void mbedtls_x509_crt_free(mbedtls_x509_crt *){ hostTlsLive--; }
+inline int mbedtls_entropy_func(void *, unsigned char *, size_t){ return 0; }
+inline int mbedtls_ctr_drbg_random(void *, unsigned char *, size_t){ return 0; }
+inline int mbedtls_ctr_drbg_seed(mbedtls_ctr_drbg_context *, int (*)(void *, unsigned char *, size_t), void *,
+                                 const unsigned char *, size_t){ return hostTlsSeedResult; }
+inline int mbedtls_x509_crt_parse(mbedtls_x509_crt *, const unsigned char *, size_t){ return 0; }
+inline int mbedtls_ssl_config_defaults(mbedtls_ssl_config *, int, int, int){ return 0; }
+inline void mbedtls_ssl_conf_authmode(mbedtls_ssl_config *, int){}
+inline void mbedtls_ssl_conf_ca_chain(mbedtls_ssl_config *, mbedtls_x509_crt *, void *){}
+inline void mbedtls_ssl_conf_rng(mbedtls_ssl_config *, int (*)(void *, unsigned char *, size_t), void *){}
+inline void mbedtls_ssl_conf_ciphersuites(mbedtls_ssl_config *, const int *){}
+inline void mbedtls_ssl_conf_session_tickets(mbedtls_ssl_config *, int){}
+inline int mbedtls_ssl_setup(mbedtls_ssl_context *, const mbedtls_ssl_config *){ return 0; }
+inline int mbedtls_ssl_set_hostname(mbedtls_ssl_context *, const char *){ return 0; }
+typedef int mbedtls_ssl_send_t(void *, const unsigned char *, size_t);
+typedef int mbedtls_ssl_recv_t(void *, unsigned char *, size_t);
+inline void mbedtls_ssl_set_bio(mbedtls_ssl_context *, void *, mbedtls_ssl_send_t *, mbedtls_ssl_recv_t *, void *){}
+inline int mbedtls_ssl_session_reset(mbedtls_ssl_context *){ return 0; }
+inline void mbedtls_ssl_session_init(mbedtls_ssl_session *session){ memset(session, 0, sizeof(*session)); }
+inline void mbedtls_ssl_session_free(mbedtls_ssl_session *){}
+inline int mbedtls_ssl_session_load(mbedtls_ssl_session *, const unsigned char *, size_t){ return -1; }
+inline int mbedtls_ssl_session_save(const mbedtls_ssl_session *, unsigned char *, size_t, size_t *length){ *length = 0; return 0; }
+inline int mbedtls_ssl_set_session(mbedtls_ssl_context *, const mbedtls_ssl_session *){ return 0; }
+inline int mbedtls_ssl_get_session(const mbedtls_ssl_context *, mbedtls_ssl_session *){ return -1; }
+inline int mbedtls_ssl_handshake(mbedtls_ssl_context *){ return MBEDTLS_ERR_NET_CONN_RESET; }
+inline int mbedtls_ssl_close_notify(mbedtls_ssl_context *){ return 0; }
+inline int mbedtls_ssl_write(mbedtls_ssl_context *, const unsigned char *, size_t){ return MBEDTLS_ERR_NET_CONN_RESET; }
+inline int mbedtls_ssl_read(mbedtls_ssl_context *, unsigned char *, size_t){ return MBEDTLS_ERR_NET_CONN_RESET; }
@@ -0,0 +1,416 @@
+#!/usr/bin/env python3
+"""
+Virtual device fleet for backend load testing.
+
+Runs N virtual devices in one process. Each has what a board has: its
+own identity (MAC and esp32-xxxxxx hostname), its own settings store
+(main.cpp's EEPROM layout), its own radio conditions (RSSI random walk,
+link drop chance) and one real TCP connection to the uplink, kept alive
+between posts like HttpUplink. Every device goes through the firmware's
+lifecycle:
+
+  unprovisioned -> provisioned -> connecting -> connected -> publishing
+                                       ^                          |
+                                       +------- link drop --------+
+
+The timing comes from the device's own settings store (wifi_timeout,
+wifi_retry) and from main.cpp's constants. Association fails more often
+on weak links. After a drop a device waits WIFI_TIMEOUT_MS and reconnects.
+
+Messages are what the firmware sends. The body of each POST is the class
+byte followed by the payload. State messages are "wifi:connected".
+Telemetry is a TELEMETRY_BATCH: type, sequence (u32), record count (u8),
+raw length (u16) and an LZ stream of TelemetryRecords. The stream uses
+literals only, which any lzCompress() decoder accepts.
+Send results are judged like httpResult():
+- 2xx sent
+- 4xx other than 408/429 rejected and dropped
+- anything else retried every UPLINK_RETRY_MS, up to UPLINK_MAX_ATTEMPTS
+
+The firmware is known to the backend only by its connection, so every
+device also sends "X-Device-Id: <hostname>". With --source-net each
+device also connects from its own 127.x.y.z address, for backends on
+loopback that key on the peer address.
+
+Every --report seconds it prints:
+- devices per state
+- lifecycle events per second, all devices together
+- POST results
+- RSS growth since start divided by the device count, which is the
+  memory per device, sockets and buffers included
+
+  python3 tools/fleet_sim.py --devices 10000 --url http://10.0.0.5:8080/telemetry
+  python3 tools/fleet_sim.py --devices 10000 --sink --time-scale 30 --duration 120
+
+--sink serves a built-in backend on the --url address that checks every
+message against the firmware's format and counts them; with --devices 0
+it is only that backend. Each device needs one file descriptor (two with
+--sink in the same process); the soft limit is raised to the hard limit.
+"""
+import argparse
+import asyncio
+import os
+import random
+import resource
+import struct
+import time
+import urllib.parse
+
+# From main.cpp
+EEPROM_SIZE = 300
+SETTINGS_LENGTH = 50
+PERIODS_OFFSET = SETTINGS_LENGTH * 2 + 32 + 4
+WIFI_TIMEOUT_MS = 10000
+WIFI_RETRY_PERIOD_MS = 20000
+TELEMETRY_PERIOD_MS = 1000
+BATCH_MAX_RECORDS = 64
+UPLINK_RETRY_MS = 5000
+UPLINK_MAX_ATTEMPTS = 12
+CLASS_ALARM, CLASS_STATE, CLASS_TELEMETRY, CLASS_LOG, CLASS_RELAY = range(5)
+TELEMETRY_BATCH = 0
+RECORD_FORMAT = "<IIbB"  # TelemetryRecord: timestamp, freeHeap, rssi, bleConnected
+SEND_OK, SEND_RETRY, SEND_REJECTED = range(3)
+
+# Fleet
+PUBLISH_MS = 30000       # One batch per device this often
+RAMP_MS = 10000          # Devices are provisioned spread over this
+STATES = ("unprovisioned", "connecting", "connected")
+
+
+def lz_literals(data):
+    """LZ stream of data as literals only: a zero flag byte per 8 bytes."""
+    out = bytearray()
+    for i in range(0, len(data), 8):
+        out.append(0)
+        out += data[i:i + 8]
+    return bytes(out)
+
+
+def lz_decompress(data):
+    out = bytearray()
+    pos = 0
+    while pos < len(data):
+        flags = data[pos]
+        pos += 1
+        for bit in range(8):
+            if pos >= len(data):
+                break
+            if flags & (1 << bit):
+                distance = data[pos] << 4 | data[pos + 1] >> 4
+                length = (data[pos + 1] & 0x0F) + 3
+                pos += 2
+                for _ in range(length):
+                    out.append(out[-distance])
+            else:
+                out.append(data[pos])
+                pos += 1
+    return bytes(out)
+
+
+def http_result(code):
+    if 200 <= code < 300:
+        return SEND_OK
+    if 400 <= code < 500 and code not in (408, 429):
+        return SEND_REJECTED
+    return SEND_RETRY
+
+
+class Stats:
+    def __init__(self):
+        self.states = [0] * len(STATES)
+        self.events = 0
+        self.counts = {}
+
+    def count(self, name, event=True):
+        self.counts[name] = self.counts.get(name, 0) + 1
+        self.events += event
+
+    def move(self, old, new):
+        self.states[old] -= 1
+        self.states[new] += 1
+
+
+class Device:
+    """One virtual device: identity, settings store, radio and link."""
+
+    def __init__(self, index, args, stats):
+        self.args = args
+        self.stats = stats
+        self.random = random.Random(args.seed * 1000003 + index)
+        self.index = index
+        mac = 0x24A16000_0000 | index
+        self.mac = mac
+        self.hostname = "esp32-%06x" % (mac & 0xFFFFFF)
+        self.settings = bytearray(EEPROM_SIZE)
+        self.rssi = -40 - self.random.randrange(50)
+        self.drop_percent = self.random.randrange(10)
+        self.state = 0
+        self.sequence = 0
+        self.started = time.monotonic()
+        self.reader = None
+        self.writer = None
+        stats.states[0] += 1
+
+    # Settings store, laid out like the firmware's EEPROM
+    def setting_write(self, offset, value, size):
+        self.settings[offset:offset + size] = value.ljust(size, b"\0")[:size]
+
+    def period(self, index, default):
+        value, = struct.unpack_from("<I", self.settings, PERIODS_OFFSET + index * 4)
+        return value if value != 0 and value <= 3600000 else default
+
+    def millis(self):
+        return int((time.monotonic() - self.started) * 1000 * self.args.time_scale) & 0xFFFFFFFF
+
+    async def sleep_ms(self, ms):
+        await asyncio.sleep(ms / 1000 / self.args.time_scale)
+
+    def set_state(self, state):
+        self.stats.move(self.state, state)
+        self.state = state
+
+    async def run(self):
+        await self.sleep_ms(self.random.randrange(self.args.ramp_ms))
+        self.setting_write(0, self.args.network.encode(), SETTINGS_LENGTH)
+        self.setting_write(SETTINGS_LENGTH, self.args.password.encode(), SETTINGS_LENGTH)
+        self.stats.count("provision")
+        self.set_state(1)
+        connected_before = False
+        while True:
+            if not await self.associate():
+                await self.sleep_ms(self.period(3, WIFI_RETRY_PERIOD_MS))
+                continue
+            self.set_state(2)
+            self.stats.count("reconnect" if connected_before else "connect")
+            connected_before = True
+            await self.publish(CLASS_STATE, b"wifi:connected")
+            while await self.publish_batch():
+                await self.sleep_ms(self.args.publish_ms)
+            self.close()
+            self.set_state(1)
+            self.stats.count("drop")
+            await self.sleep_ms(self.period(0, WIFI_TIMEOUT_MS))
+
+    async def associate(self):
+        # Weak virtual links fail to associate more often
+        if self.random.randrange(100) >= 100 + (self.rssi + 40) * 2:
+            self.stats.count("associate_failed")
+            return False
+        return True
+
+    async def publish_batch(self):
+        """Sends one telemetry batch; False when the virtual link drops."""
+        if self.random.randrange(100) < self.drop_percent:
+            return False
+        self.rssi = max(-95, min(-30, self.rssi + self.random.randrange(5) - 2))
+        count = min(BATCH_MAX_RECORDS, max(1, self.args.publish_ms // TELEMETRY_PERIOD_MS))
+        now = self.millis()
+        records = b"".join(struct.pack(RECORD_FORMAT, (now - (count - 1 - i) * TELEMETRY_PERIOD_MS) & 0xFFFFFFFF,
+                                       150000 - self.random.randrange(2000), self.rssi, 0) for i in range(count))
+        self.sequence += 1
+        header = struct.pack("<BIBH", TELEMETRY_BATCH, self.sequence, count, len(records))
+        await self.publish(CLASS_TELEMETRY, header + lz_literals(records))
+        return True
+
+    async def publish(self, message_class, payload):
+        body = bytes([message_class]) + payload
+        for attempt in range(1, UPLINK_MAX_ATTEMPTS + 1):
+            result = await self.post(body)
+            if result == SEND_OK:
+                self.stats.count("sent")
+                return
+            if result == SEND_REJECTED:
+                self.stats.count("rejected")
+                return
+            self.stats.count("retry", False)
+            await self.sleep_ms(UPLINK_RETRY_MS)
+        self.stats.count("abandoned")
+
+    async def post(self, body):
+        # Like HttpUplink: one kept-alive connection, reopened when closed
+        for _ in range(2):
+            try:
+                if self.writer is None:
+                    await self.open()
+                self.writer.write(self.args.request_head % (self.hostname.encode(), len(body)) + body)
+                code = await self.read_response()
+                if code > 0:
+                    return http_result(code)
+            except (OSError, asyncio.IncompleteReadError, ValueError):
+                self.stats.count("connection_error", False)
+            self.close()
+        return SEND_RETRY
+
+    async def open(self):
+        local = None
+        if self.args.source_net:
+            n = self.index + 1
+            local = ("127.%d.%d.%d" % (n >> 16 & 0xFF, n >> 8 & 0xFF, n & 0xFF), 0)
+        self.reader, self.writer = await asyncio.open_connection(self.args.host, self.args.port, local_addr=local)
+
+    async def read_response(self):
+        status = await self.reader.readline()
+        if not status:
+            return -1
+        code = int(status.split()[1])
+        length = 0
+        keep_alive = True
+        while True:
+            line = await self.reader.readline()
+            if line in (b"\r\n", b"\n", b""):
+                break
+            name, _, value = line.decode("latin-1").partition(":")
+            name = name.strip().lower()
+            if name == "content-length":
+                length = int(value)
+            elif name == "connection" and value.strip().lower() == "close":
+                keep_alive = False
+        if length:
+            await self.reader.readexactly(length)
+        if not keep_alive:
+            self.close()
+        return code
+
+    def close(self):
+        if self.writer is not None:
+            self.writer.close()
+        self.reader = self.writer = None
+
+
+class Sink:
+    """Minimal backend that checks messages against the firmware format."""
+
+    def __init__(self):
+        self.devices = set()
+        self.counts = {}
+
+    def count(self, name):
+        self.counts[name] = self.counts.get(name, 0) + 1
+
+    def check(self, body):
+        if not body:
+            return "empty"
+        if body[0] == CLASS_STATE:
+            return "state"
+        if body[0] != CLASS_TELEMETRY or len(body) < 9 or body[1] != TELEMETRY_BATCH:
+            return "unknown"
+        _, _, count, raw_length = struct.unpack_from("<BIBH", body, 1)
+        raw = lz_decompress(body[9:])
+        if len(raw) != raw_length or raw_length != count * struct.calcsize(RECORD_FORMAT):
+            return "malformed"
+        return "telemetry"
+
+    async def serve(self, reader, writer):
+        try:
+            while True:
+                line = await reader.readline()
+                if not line:
+                    break
+                length = 0
+                device = None
+                while True:
+                    header = await reader.readline()
+                    if header in (b"\r\n", b""):
+                        break
+                    name, _, value = header.decode("latin-1").partition(":")
+                    if name.lower() == "content-length":
+                        length = int(value)
+                    elif name.lower() == "x-device-id":
+                        device = value.strip()
+                body = await reader.readexactly(length)
+                self.devices.add(device)
+                self.count(self.check(body))
+                writer.write(b"HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n")
+        except (OSError, asyncio.IncompleteReadError, asyncio.CancelledError):
+            pass
+        writer.close()
+
+
+def rss_bytes():
+    with open("/proc/self/statm") as f:
+        return int(f.read().split()[1]) * os.sysconf("SC_PAGE_SIZE")
+
+
+async def report(args, stats, sink, baseline):
+    last_events = 0
+    last = time.monotonic()
+    while True:
+        await asyncio.sleep(args.report)
+        now = time.monotonic()
+        rate = (stats.events - last_events) / (now - last)
+        last_events, last = stats.events, now
+        if args.devices == 0:
+            print("[SINK] %d devices seen, %s" % (len(sink.devices),
+                  " ".join("%s:%d" % item for item in sorted(sink.counts.items()))), flush=True)
+            continue
+        per_device = (rss_bytes() - baseline) / args.devices
+        print("[FLEET] %d devices (%s), %.0f events/s, %.0f bytes/device, %s" % (
+            args.devices, ", ".join("%d %s" % (n, s) for n, s in zip(stats.states, STATES)), rate, per_device,
+            " ".join("%s:%d" % item for item in sorted(stats.counts.items()))), flush=True)
+        if sink is not None:
+            print("[SINK] %d devices seen, %s" % (len(sink.devices),
+                  " ".join("%s:%d" % item for item in sorted(sink.counts.items()))), flush=True)
+
+
+async def run(args):
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    needed = args.devices * (2 if args.sink else 1) + 64
+    if soft < needed:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (min(hard, needed), hard))
+        if hard < needed:
+            print("warning: only %d file descriptors, %d devices need %d" % (hard, args.devices, needed))
+    sink = server = None
+    if args.sink:
+        sink = Sink()
+        server = await asyncio.start_server(sink.serve, args.host, args.port, backlog=4096)
+    baseline = rss_bytes()
+    stats = Stats()
+    devices = [Device(i, args, stats) for i in range(args.devices)]
+    tasks = [asyncio.ensure_future(device.run()) for device in devices]
+    reporter = asyncio.ensure_future(report(args, stats, sink, baseline))
+    try:
+        if args.duration > 0:
+            await asyncio.sleep(args.duration)
+        else:
+            await asyncio.gather(*tasks, reporter)
+    finally:
+        reporter.cancel()
+        for task in tasks:
+            task.cancel()
+        for device in devices:
+            device.close()
+        if server is not None:
+            server.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Virtual device fleet for backend load testing")
+    parser.add_argument("--devices", type=int, default=1000)
+    parser.add_argument("--url", default="http://127.0.0.1:8080/telemetry", help="UPLINK_URL to post to")
+    parser.add_argument("--sink", action="store_true", help="serve a checking backend on --url")
+    parser.add_argument("--source-net", action="store_true", help="connect each device from its own 127.x.y.z")
+    parser.add_argument("--network", default="Enter your network")
+    parser.add_argument("--password", default="Enter your password")
+    parser.add_argument("--publish-ms", type=int, default=PUBLISH_MS)
+    parser.add_argument("--ramp-ms", type=int, default=RAMP_MS)
+    parser.add_argument("--time-scale", type=float, default=1.0, help="device time runs this much faster")
+    parser.add_argument("--duration", type=float, default=0, help="seconds, 0 = until interrupted")
+    parser.add_argument("--report", type=float, default=10, help="seconds between reports")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+    url = urllib.parse.urlsplit(args.url)
+    if url.scheme != "http":
+        parser.error("only http:// uplinks are simulated")
+    args.host = url.hostname
+    args.port = url.port or 80
+    args.request_head = ("POST %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: ESP32HTTPClient\r\nConnection: keep-alive\r\n"
+                         "Content-Type: application/octet-stream\r\nX-Device-Id: %%s\r\nContent-Length: %%d\r\n\r\n"
+                         % (url.path or "/", url.netloc)).encode()
+    try:
+        asyncio.run(run(args))
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
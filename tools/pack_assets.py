@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""
+Packs a directory of static web assets into the image main.cpp serves
+from the "assets" flash partition.
+
+Every file is gzip-compressed and placed behind an index, so the
+firmware can map the partition and send files straight from flash.
+
+Layout (little-endian):
+  header: magic "WAST", entry count (u32)
+  entry:  path (56 bytes, NUL padded), offset (u32), length (u32),
+          etag (u32, CRC-32 of the compressed data)
+  data:   gzip streams, 4-byte aligned
+
+Add a data partition named "assets" to your partition table, e.g.
+  assets, data, 0x40, , 0x40000
+then:
+  python3 tools/pack_assets.py data/www assets.bin
+  esptool.py write_flash <assets partition offset> assets.bin
+"""
+import gzip
+import os
+import struct
+import sys
+import zlib
+
+PATH_LENGTH = 56
+ENTRY_FORMAT = "<%dsIII" % PATH_LENGTH
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: pack_assets.py <asset directory> <output image>")
+    root, output = sys.argv[1], sys.argv[2]
+    files = []
+    for directory, _, names in sorted(os.walk(root)):
+        for name in sorted(names):
+            full = os.path.join(directory, name)
+            path = "/" + os.path.relpath(full, root).replace(os.sep, "/")
+            if len(path) >= PATH_LENGTH:
+                sys.exit("path too long: " + path)
+            with open(full, "rb") as f:
+                # mtime=0 keeps images (and ETags) reproducible
+                files.append((path, gzip.compress(f.read(), 9, mtime=0)))
+
+    offset = 8 + len(files) * struct.calcsize(ENTRY_FORMAT)
+    index = b""
+    data = b""
+    for path, blob in files:
+        padding = -(offset + len(data)) % 4
+        data += b"\0" * padding
+        index += struct.pack(ENTRY_FORMAT, path.encode(), offset + len(data), len(blob), zlib.crc32(blob))
+        data += blob
+
+    with open(output, "wb") as f:
+        f.write(b"WAST" + struct.pack("<I", len(files)) + index + data)
+    print("%d assets, %d bytes" % (len(files), offset + len(data)))
+
+
+if __name__ == "__main__":
+    main()
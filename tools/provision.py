@@ -0,0 +1,349 @@
+#!/usr/bin/env python3
+"""
+Bulk WiFi provisioning: many devices at once, from Linux.
+
+Drives main.cpp's provisioning protocol with one session per device and
+up to --concurrency sessions at a time.
+
+BLE (the provisioning service):
+  1. Subscribe to STATUS_UUID.
+  2. Write NETWORK_UUID and PASSWORD_UUID back to back, without
+     response, so both go out in the same connection event.
+  3. After each commit the device notifies "<field>:<digest>", or
+     "<field>:error" if the flash write failed. The digest is the
+     CRC-32 of network and password, each NUL padded to
+     SETTINGS_LENGTH.
+  A device is done when "password:<digest>" matches what was sent.
+  --no-pipeline waits for each notification before the next write,
+  for comparison.
+
+Serial (factory UART, firmware built with FACTORY_PROVISION 1):
+  One SET frame carries both settings. The reply carries status and
+  the digest. Frame: SOF 0x7E, type, length (u16 LE), payload, CRC-32
+  of type..payload.
+
+Loopback: simulated devices in this process, with the firmware's
+settings store, digest and status notifications, plus BLE timing
+(--connect-ms, --interval-ms, --commit-ms). Use it to benchmark
+devices per minute without radios.
+
+  python3 tools/provision.py loopback --devices 1000 --concurrency 64
+  python3 tools/provision.py ble --network lab --password secret --scan 10
+  python3 tools/provision.py serial /dev/ttyUSB0 /dev/ttyUSB1 --network lab --password secret
+
+As a library:
+  results = await provision_many(LoopbackTransport(), addresses, network, password, concurrency=64)
+
+BLE needs bleak, serial needs pyserial; both are imported only when used.
+"""
+import argparse
+import asyncio
+import random
+import struct
+import sys
+import time
+import zlib
+
+# From main.cpp
+SERVICE_UUID = "4fafc201-1fb5-459e-8fcc-c5c9c331914b"
+NETWORK_UUID = "beb5483e-36e1-4688-b7f5-ea07361b26a8"
+PASSWORD_UUID = "beb5483e-36e1-4688-b7f5-ea07361b26a9"
+STATUS_UUID = "beb5483e-36e1-4688-b7f5-ea07361b26aa"
+SETTINGS_LENGTH = 50
+PROVISION_BAUD = 2000000
+PROVISION_SOF = 0x7E
+PROVISION_SET = 0x01
+PROVISION_REPLY = 0x80
+PROVISION_STATUS = {0: "ok", 1: "bad CRC", 2: "bad payload", 3: "unknown request", 4: "commit failed"}
+
+FIELDS = {NETWORK_UUID: "network", PASSWORD_UUID: "password"}
+
+
+class ProvisionError(Exception):
+    pass
+
+
+def settings_digest(network, password):
+    """What the device reports once both settings are stored."""
+    return zlib.crc32(network.ljust(SETTINGS_LENGTH, b"\0") + password.ljust(SETTINGS_LENGTH, b"\0"))
+
+
+class GattSession:
+    """Provisioning over the BLE service; subclasses move the bytes."""
+
+    async def write(self, uuid, data):
+        raise NotImplementedError
+
+    async def notification(self, timeout):
+        raise NotImplementedError
+
+    async def close(self):
+        pass
+
+    async def status(self, field, timeout):
+        # Other fields ("boot", "config") may be notified in between
+        deadline = time.monotonic() + timeout
+        while True:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                raise ProvisionError("no %s status" % field)
+            name, _, value = (await self.notification(remaining)).partition(":")
+            if name != field:
+                continue
+            if value == "error":
+                raise ProvisionError("%s commit failed" % field)
+            return int(value, 16)
+
+    async def provision(self, network, password, pipeline, timeout):
+        if pipeline:
+            await self.write(NETWORK_UUID, network)
+            await self.write(PASSWORD_UUID, password)
+            await self.status("network", timeout)
+        else:
+            await self.write(NETWORK_UUID, network)
+            await self.status("network", timeout)
+            await self.write(PASSWORD_UUID, password)
+        return await self.status("password", timeout)
+
+
+# Loopback transport
+class SimulatedDevice:
+    """The firmware's side of the provisioning service, with BLE timing."""
+
+    def __init__(self, address, args, rng):
+        self.address = address
+        self.args = args
+        self.random = rng
+        self.settings = bytearray(SETTINGS_LENGTH * 2)
+
+    def digest(self):
+        return zlib.crc32(bytes(self.settings))
+
+    async def serve(self, writes, notifications):
+        # Writes are handled one by one, like the BLE stack's callbacks
+        loop = asyncio.get_running_loop()
+        while True:
+            arrival, uuid, data = await writes.get()
+            await asyncio.sleep(max(0, arrival - loop.time()))
+            field = FIELDS[uuid]
+            offset = 0 if uuid == NETWORK_UUID else SETTINGS_LENGTH
+            self.settings[offset:offset + SETTINGS_LENGTH] = data[:SETTINGS_LENGTH - 1].ljust(SETTINGS_LENGTH, b"\0")
+            await asyncio.sleep(self.args.commit_ms / 1000)
+            if self.random.random() * 100 < self.args.fail_percent:
+                status = "%s:error" % field
+            else:
+                status = "%s:%08x" % (field, self.digest())
+            await asyncio.sleep(self.random.uniform(0, self.args.interval_ms) / 1000)
+            notifications.put_nowait(status)
+
+
+class LoopbackSession(GattSession):
+    def __init__(self, device):
+        self.device = device
+        self.writes = asyncio.Queue()
+        self.notifications = asyncio.Queue()
+        self.server = asyncio.ensure_future(device.serve(self.writes, self.notifications))
+
+    async def write(self, uuid, data):
+        # Goes out at the next connection event
+        delay = self.device.random.uniform(0, self.device.args.interval_ms) / 1000
+        self.writes.put_nowait((asyncio.get_running_loop().time() + delay, uuid, data))
+
+    async def notification(self, timeout):
+        try:
+            return await asyncio.wait_for(self.notifications.get(), timeout)
+        except asyncio.TimeoutError:
+            raise ProvisionError("timeout")
+
+    async def close(self):
+        self.server.cancel()
+
+
+class LoopbackTransport:
+    def __init__(self, args=None, seed=1):
+        self.args = args or argparse.Namespace(connect_ms=300, interval_ms=15, commit_ms=30, fail_percent=0)
+        self.random = random.Random(seed)
+        self.devices = {}
+
+    def addresses(self, count):
+        return ["24:a1:60:%02x:%02x:%02x" % (i >> 16 & 0xFF, i >> 8 & 0xFF, i & 0xFF) for i in range(count)]
+
+    async def session(self, address):
+        if address not in self.devices:
+            self.devices[address] = SimulatedDevice(address, self.args, random.Random(self.random.random()))
+        # Advertising, connection setup and service discovery
+        await asyncio.sleep(self.random.uniform(0.5, 1.5) * self.args.connect_ms / 1000)
+        return LoopbackSession(self.devices[address])
+
+
+# BLE transport
+class BleSession(GattSession):
+    def __init__(self, client):
+        self.client = client
+        self.notifications = asyncio.Queue()
+
+    async def start(self):
+        await self.client.start_notify(STATUS_UUID, lambda _, data: self.notifications.put_nowait(data.decode()))
+
+    async def write(self, uuid, data):
+        # Without response only fits one ATT packet; longer values need a long write
+        await self.client.write_gatt_char(uuid, data, response=len(data) > self.client.mtu_size - 3)
+
+    async def notification(self, timeout):
+        try:
+            return await asyncio.wait_for(self.notifications.get(), timeout)
+        except asyncio.TimeoutError:
+            raise ProvisionError("timeout")
+
+    async def close(self):
+        await self.client.disconnect()
+
+
+class BleTransport:
+    def __init__(self):
+        import bleak
+        self.bleak = bleak
+
+    async def scan(self, seconds):
+        found = await self.bleak.BleakScanner.discover(timeout=seconds, service_uuids=[SERVICE_UUID])
+        return [device.address for device in found]
+
+    async def session(self, address):
+        client = self.bleak.BleakClient(address)
+        await client.connect()
+        session = BleSession(client)
+        try:
+            await session.start()
+        except Exception:
+            await client.disconnect()
+            raise
+        return session
+
+
+# Serial transport
+class SerialSession:
+    def __init__(self, port):
+        import serial
+        self.port = serial.Serial(port, PROVISION_BAUD, timeout=1)
+
+    async def provision(self, network, password, pipeline, timeout):
+        payload = network + b"\0" + password + b"\0"
+        body = struct.pack("<BH", PROVISION_SET, len(payload)) + payload
+        frame = bytes([PROVISION_SOF]) + body + struct.pack("<I", zlib.crc32(body))
+        reply = await asyncio.get_running_loop().run_in_executor(None, self.exchange, frame)
+        if len(reply) != 13 or reply[0] != PROVISION_SOF or reply[1] != PROVISION_SET | PROVISION_REPLY or \
+                struct.unpack_from("<I", reply, 9)[0] != zlib.crc32(reply[1:9]):
+            raise ProvisionError("bad reply")
+        if reply[4] != 0:
+            raise ProvisionError(PROVISION_STATUS.get(reply[4], "status %d" % reply[4]))
+        return struct.unpack_from("<I", reply, 5)[0]
+
+    def exchange(self, frame):
+        self.port.reset_input_buffer()
+        self.port.write(frame)
+        return self.port.read(13)
+
+    async def close(self):
+        self.port.close()
+
+
+class SerialTransport:
+    async def session(self, address):
+        return SerialSession(address)
+
+
+async def provision_one(transport, address, network, password, pipeline=True, timeout=5, retries=2):
+    """Returns (address, error or None, seconds)."""
+    start = time.monotonic()
+    expected = settings_digest(network, password)
+    error = None
+    for _ in range(retries + 1):
+        session = None
+        try:
+            session = await transport.session(address)
+            digest = await session.provision(network, password, pipeline, timeout)
+            error = None if digest == expected else "digest %08x, expected %08x" % (digest, expected)
+        except Exception as e:
+            error = str(e) or type(e).__name__
+        finally:
+            if session is not None:
+                await session.close()
+        if error is None:
+            break
+    return address, error, time.monotonic() - start
+
+
+async def provision_many(transport, addresses, network, password, concurrency=8, pipeline=True, timeout=5,
+                         retries=2, progress=None):
+    """Provisions every address, at most concurrency at once."""
+    if len(network) >= SETTINGS_LENGTH or len(password) >= SETTINGS_LENGTH:
+        raise ValueError("network and password must be under %d bytes" % SETTINGS_LENGTH)
+    limit = asyncio.Semaphore(concurrency)
+
+    async def one(address):
+        async with limit:
+            result = await provision_one(transport, address, network, password, pipeline, timeout, retries)
+        if progress is not None:
+            progress(result)
+        return result
+    return await asyncio.gather(*(one(address) for address in addresses))
+
+
+def summary(results, elapsed):
+    failed = [result for result in results if result[1] is not None]
+    times = sorted(result[2] for result in results)
+    print("%d devices in %.1f s: %.0f devices/minute, %d failed, p50 %.2f s, p95 %.2f s" % (
+        len(results), elapsed, len(results) / elapsed * 60, len(failed),
+        times[len(times) // 2], times[min(len(times) - 1, len(times) * 95 // 100)]))
+    for address, error, _ in failed:
+        print("  %s: %s" % (address, error))
+    return 1 if failed else 0
+
+
+async def run(args):
+    if args.transport == "loopback":
+        transport = LoopbackTransport(args, args.seed)
+        addresses = transport.addresses(args.devices)
+    elif args.transport == "ble":
+        transport = BleTransport()
+        addresses = args.addresses + (await transport.scan(args.scan) if args.scan else [])
+    else:
+        transport = SerialTransport()
+        addresses = args.addresses
+    if not addresses:
+        sys.exit("no devices")
+
+    def progress(result):
+        if args.verbose:
+            print("%s %s %.2f s" % (result[0], result[1] or "ok", result[2]), flush=True)
+    start = time.monotonic()
+    results = await provision_many(transport, addresses, args.network.encode(), args.password.encode(),
+                                   args.concurrency, not args.no_pipeline, args.timeout, args.retries, progress)
+    return summary(results, time.monotonic() - start)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Bulk WiFi provisioning")
+    parser.add_argument("transport", choices=("loopback", "ble", "serial"))
+    parser.add_argument("addresses", nargs="*", help="BLE addresses or serial ports")
+    parser.add_argument("--network", default="Enter your network")
+    parser.add_argument("--password", default="Enter your password")
+    parser.add_argument("--concurrency", type=int, default=8, help="sessions at once")
+    parser.add_argument("--no-pipeline", action="store_true", help="wait for each status before the next write")
+    parser.add_argument("--timeout", type=float, default=5, help="seconds per status")
+    parser.add_argument("--retries", type=int, default=2)
+    parser.add_argument("--scan", type=float, default=0, help="BLE: also scan this many seconds for devices")
+    parser.add_argument("--verbose", action="store_true")
+    loopback = parser.add_argument_group("loopback")
+    loopback.add_argument("--devices", type=int, default=100)
+    loopback.add_argument("--connect-ms", type=float, default=300, help="connection setup and discovery")
+    loopback.add_argument("--interval-ms", type=float, default=15, help="connection interval")
+    loopback.add_argument("--commit-ms", type=float, default=30, help="EEPROM commit")
+    loopback.add_argument("--fail-percent", type=float, default=0, help="commits that fail")
+    loopback.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+    sys.exit(asyncio.run(run(args)))
+
+
+if __name__ == "__main__":
+    main()